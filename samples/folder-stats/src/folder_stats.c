@@ -29,13 +29,16 @@ static char *lstrdup (const char *src)
    return ret;
 }
 
+// The result is allocated from the Q_PATHNAMES slab, so that posting a
+// pathname does not call malloc(); the consumer releases it with
+// amq_msg_release().
 static char *lstrcat (const char *s1, const char *s2, const char *s3)
 {
    size_t s1_len = strlen (s1);
    size_t s2_len = strlen (s2);
    size_t s3_len = strlen (s3);
 
-   char *ret = malloc (s1_len + s2_len + s3_len + 1);
+   char *ret = amq_msg_alloc (Q_PATHNAMES, s1_len + s2_len + s3_len + 1);
    if (!ret) {
       return NULL;
    }
@@ -56,10 +59,15 @@ struct folder_stats_entry_t {
    uint64_t     f_mtime;
 };
 
+// Directory entries are posted in batches of this many.
+#define POST_BATCH      (64)
+
 static void post_direntries (const char *dirname)
 {
    char *tmp_fname = NULL;
    DIR *dirp = NULL;
+   void *batch[POST_BATCH];
+   size_t nbatch = 0;
 
    if (!(dirp = opendir (dirname))) {
       AMQ_ERROR_POST (errno, "Failed to read directory entries in [%s]: %m\n", dirname);
@@ -77,10 +85,17 @@ static void post_direntries (const char *dirname)
          goto errorexit;
       }
 
-      amq_post (Q_PATHNAMES, tmp_fname, 0);
+      batch[nbatch++] = tmp_fname;
+      if (nbatch == POST_BATCH) {
+         amq_post_many (Q_PATHNAMES, batch, NULL, nbatch);
+         nbatch = 0;
+      }
    }
 
 errorexit:
+   if (nbatch)
+      amq_post_many (Q_PATHNAMES, batch, NULL, nbatch);
+
    if (dirp)
       closedir (dirp);
 }
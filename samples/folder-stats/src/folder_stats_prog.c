@@ -35,9 +35,11 @@ static int setenv (const char *name, const char *value, int overwrite)
 }
 #endif
 
-static char *lstrdup (const char *src)
+// Pathnames are allocated from the Q_PATHNAMES slab, and released by
+// wfpath_open().
+static char *pathname_dup (const char *src)
 {
-   char *ret = malloc (strlen (src) + 1);
+   char *ret = amq_msg_alloc (Q_PATHNAMES, strlen (src) + 1);
    if (ret)
       strcpy (ret, src);
    return ret;
@@ -106,6 +108,9 @@ enum amq_worker_result_t errhandler (const struct amq_worker_t *self,
    (void)cdata;
 
    fprintf (stderr, "Error %i: [%s]\n", error->code, error->message);
+   if (error->repeats) {
+      fprintf (stderr, "   (%zu more from the same place not shown)\n", error->repeats);
+   }
    if (error->code == INT_MAX) {
       g_endflag = 1;
    }
@@ -147,12 +152,12 @@ enum amq_worker_result_t wfpath_open (const struct amq_worker_t *self,
 
    folder_stats_entry_t *entry = folder_stats_entry_new (pathname);
    if (!entry) {
-      free (pathname);
+      amq_msg_release (pathname);
       return amq_worker_result_CONTINUE;
    }
 
    amq_post (Q_OUTPUT, entry, 0);
-   free (pathname);
+   amq_msg_release (pathname);
 
    return amq_worker_result_CONTINUE;
 }
@@ -207,8 +212,11 @@ int main (int argc, char **argv)
       goto errorexit;
    }
 
-   // A queue to interrogate a single pathname that creates the fentry object
-   if (!(amq_message_queue_create (Q_PATHNAMES))) {
+   // A queue to interrogate a single pathname that creates the fentry object.
+   // The workers post the entries of each directory they find back onto this
+   // queue, so each worker keeps its own entries and steals from the others
+   // when it runs out.
+   if (!(amq_message_queue_create_ex (Q_PATHNAMES, amq_queue_engine_STEAL, 0))) {
       printf ("Failed to create folder queue\n");
       goto errorexit;
    }
@@ -235,7 +243,7 @@ int main (int argc, char **argv)
       }
    }
 
-   amq_post (Q_PATHNAMES, lstrdup (scan_path), 0);
+   amq_post (Q_PATHNAMES, pathname_dup (scan_path), 0);
 
    AMQ_ERROR_POST (0, "Successfully initialised");
 
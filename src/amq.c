@@ -2,9 +2,15 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <errno.h>
 #include <time.h>
+#include <math.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <pthread.h>
 
@@ -14,6 +20,13 @@
 
 #include "amq.h"
 #include "amq_container.h"
+#include "amq_epoch.h"
+#include "amq_evfd.h"
+#include "amq_futex.h"
+#include "amq_ring.h"
+#include "amq_slab.h"
+#include "amq_spill.h"
+#include "amq_thread.h"
 
 /* ************************************************************
  * The global queue container
@@ -26,55 +39,102 @@ amq_container_t *g_queue_container;
 amq_container_t *g_worker_container;
 
 /* ************************************************************
- * Error objects, for the error queue
+ * The global topic container
  */
+amq_container_t *g_topic_container;
 
-struct amq_error_t *amq_error_new (const char *file, int line, int code, ...)
-{
-   bool error = true;
-   char *prefix = NULL;
-   char *message = NULL;
+/* ************************************************************
+ * Error objects, for the error queue. The objects live in a static pool and
+ * the free ones are kept on a lock-free stack of indices. The head of the
+ * stack carries a tag that changes on every pop, so that a pop that was
+ * overtaken by a pop and a push of the same index cannot succeed.
+ */
+#define ERROR_WINDOW_NS    (1000000000ULL)
 
-   struct amq_error_t *ret = calloc (1, sizeof *ret);
+static struct amq_error_t g_error_pool[AMQ_ERROR_POOL_SIZE];
+static uint32_t g_error_next[AMQ_ERROR_POOL_SIZE];
 
-   if (!ret) {
-      AMQ_ERROR_POST (-1, "Out of memory error: Failed to allocate memory for error object\n");
-      return NULL;
-   }
-   ret->code = code;
+// The index of the top of the stack plus one (0 when empty) in the low 32
+// bits, and the tag in the high 32 bits.
+static uint64_t g_error_free;
+static pthread_once_t g_error_once = PTHREAD_ONCE_INIT;
 
-   va_list ap;
-   va_start (ap, code);
+static uint64_t clock_ns (void);
 
-   const char *fmts = va_arg (ap, const char *);
-   if ((ds_str_vprintf (&message, fmts, ap))==0) {
-      AMQ_ERROR_POST (-1, "Out of memory error: Failed to allocate memory for error message\n");
-      goto errorexit;
+static void error_pool_init (void)
+{
+   for (uint32_t i=0; i<AMQ_ERROR_POOL_SIZE; i++) {
+      g_error_next[i] = i + 2 <= AMQ_ERROR_POOL_SIZE ? i + 2 : 0;
    }
+   __atomic_store_n (&g_error_free, 1, __ATOMIC_RELEASE);
+}
 
-   if ((ds_str_printf (&prefix, "[%s:%i] [code:%i]", file, line, code))==0) {
-      AMQ_ERROR_POST (-1, "Out of memory error: Failed to allocate memory for error message\n");
-      goto errorexit;
+static struct amq_error_t *error_pool_get (void)
+{
+   pthread_once (&g_error_once, error_pool_init);
+
+   uint64_t head = __atomic_load_n (&g_error_free, __ATOMIC_ACQUIRE);
+   for (;;) {
+      uint32_t top = (uint32_t)head;
+      if (!top)
+         return NULL;
+
+      uint64_t next = ((head >> 32) + 1) << 32
+                    | __atomic_load_n (&g_error_next[top - 1], __ATOMIC_RELAXED);
+      if ((__atomic_compare_exchange_n (&g_error_free, &head, next, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)))
+         return &g_error_pool[top - 1];
    }
+}
 
-   if (!(ret->message = ds_str_cat (prefix, " ", message, NULL))) {
-      AMQ_ERROR_POST (-1, "Out of memory error: Failed to generate final message\n");
-      goto errorexit;
-   }
+static void error_pool_put (struct amq_error_t *errobj)
+{
+   uint32_t index = (uint32_t)(errobj - g_error_pool);
+
+   uint64_t head = __atomic_load_n (&g_error_free, __ATOMIC_RELAXED);
+   do {
+      __atomic_store_n (&g_error_next[index], (uint32_t)head, __ATOMIC_RELAXED);
+   } while (!(__atomic_compare_exchange_n (&g_error_free, &head,
+                                           (head & ~(uint64_t)UINT32_MAX) | (index + 1),
+                                           true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)));
+}
 
-   error = false;
+// Format into dst, which is AMQ_ERROR_MESSAGE_SIZE bytes, truncating if needed.
+static void error_format (char *dst, const char *file, int line, int code,
+                          const char *fmts, va_list ap)
+{
+   int prefix = snprintf (dst, AMQ_ERROR_MESSAGE_SIZE, "[%s:%i] [code:%i] ", file, line, code);
+   if (prefix < 0)
+      prefix = 0;
+   if (prefix < AMQ_ERROR_MESSAGE_SIZE)
+      vsnprintf (&dst[prefix], AMQ_ERROR_MESSAGE_SIZE - prefix, fmts, ap);
+}
 
-errorexit:
+static uint32_t error_hash (const char *message)
+{
+   uint32_t ret = 2166136261u;
+   while (*message) {
+      ret ^= (uint8_t)*message++;
+      ret *= 16777619u;
+   }
+   return ret;
+}
 
-   va_end (ap);
+struct amq_error_t *amq_error_new (const char *file, int line, int code, ...)
+{
+   struct amq_error_t *ret = error_pool_get ();
+   if (!ret)
+      return NULL;
 
-   free (message);
-   free (prefix);
+   va_list ap;
+   va_start (ap, code);
+   const char *fmts = va_arg (ap, const char *);
+   error_format (ret->text, file, line, code, fmts, ap);
+   va_end (ap);
 
-   if (error) {
-      amq_error_del (ret);
-      ret = NULL;
-   }
+   ret->code = code;
+   ret->message = ret->text;
+   ret->repeats = 0;
 
    return ret;
 }
@@ -82,43 +142,306 @@ errorexit:
 void amq_error_del (struct amq_error_t *errobj)
 {
    if (errobj)
-      free (errobj->message);
+      error_pool_put (errobj);
+}
+
+// Discard function for the error queue.
+static void error_discard (void *errobj, size_t len)
+{
+   (void)len;
+   amq_error_del (errobj);
+}
+
+void amq_error_post (struct amq_error_site_t *site, const char *file, int line,
+                     int code, ...)
+{
+   uint64_t now = clock_ns ();
+   uint64_t window = __atomic_load_n (&site->window_ns, __ATOMIC_RELAXED);
+
+   // Whichever thread moves the site on to a new window resets it; the counts
+   // are only approximate when several threads report from the site at once.
+   if (now - window >= ERROR_WINDOW_NS &&
+       __atomic_compare_exchange_n (&site->window_ns, &window, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      __atomic_store_n (&site->nposted, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&site->last_hash, 0, __ATOMIC_RELAXED);
+   }
+
+   // Over the rate limit there is no need to even format the message.
+   if (__atomic_load_n (&site->nposted, __ATOMIC_RELAXED) >= AMQ_ERROR_SITE_RATE) {
+      __atomic_add_fetch (&site->repeats, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   char message[AMQ_ERROR_MESSAGE_SIZE];
+   va_list ap;
+   va_start (ap, code);
+   const char *fmts = va_arg (ap, const char *);
+   error_format (message, file, line, code, fmts, ap);
+   va_end (ap);
+
+   uint32_t hash = error_hash (message);
+   if (__atomic_exchange_n (&site->last_hash, hash, __ATOMIC_RELAXED) == hash ||
+       __atomic_fetch_add (&site->nposted, 1, __ATOMIC_RELAXED) >= AMQ_ERROR_SITE_RATE) {
+      __atomic_add_fetch (&site->repeats, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   struct amq_error_t *errobj = error_pool_get ();
+   if (!errobj) {
+      __atomic_add_fetch (&site->repeats, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   uint32_t repeats = __atomic_exchange_n (&site->repeats, 0, __ATOMIC_RELAXED);
 
-   free (errobj);
+   memcpy (errobj->text, message, sizeof message);
+   errobj->code = code;
+   errobj->message = errobj->text;
+   errobj->repeats = repeats;
+
+   // A dropped error has already been handed back to the pool.
+   enum amq_post_result_t rc = amq_post (AMQ_QUEUE_ERROR, errobj, 0);
+   if (rc != amq_post_result_OK) {
+      __atomic_add_fetch (&site->repeats, repeats + 1, __ATOMIC_RELAXED);
+      if (rc != amq_post_result_DROPPED)
+         amq_error_del (errobj);
+   }
 }
 
 
 
 /* ************************************************************
- * Queue objects, so we can keep track of queues
+ * Queue objects, so we can keep track of queues. Queues are reference
+ * counted: the queue container holds one reference, and every handle
+ * returned by amq_queue_open() and every consumer holds one more. The
+ * queue is only freed when the last reference is dropped.
+ *
+ * A queue is backed by one of several engines, and every engine is used
+ * only through non-blocking operations (cmq_wait() is called with a zero
+ * timeout). Consumers that find a queue empty, and producers that find a
+ * bounded queue full, sleep on a futex in the queue until the other side
+ * wakes them.
  */
-struct queue_t {
-   char  *name;
-   cmq_t *cmq;
+#define STEAL_MAX_CONSUMERS   (64)
+
+// A consumer that waits on several queues at once sleeps on a futex of its own,
+// and is woken through one of these on each of its queues.
+struct queue_listener_t {
+   uint32_t                *seq;
+   uint32_t                *waiting;
+   struct queue_listener_t *next;
+};
+
+// Consumers sleep on avail_seq when the queue is empty, producers sleep on
+// space_seq when the queue is full. The waiting counts let the other side
+// skip the wakeup syscall when nobody is asleep.
+struct queue_sync_t {
+   uint32_t                 avail_seq;
+   uint32_t                 avail_waiting;
+   uint32_t                 space_seq;
+   uint32_t                 space_waiting;
+};
+
+struct amq_queue_t {
+   char                    *name;
+   uint32_t                 refcount;
+   enum amq_queue_engine_t  engine;
+
+   cmq_t                   *cmq;
+   amq_ring_t              *ring;
+   amq_spsc_t              *spsc;
+   amq_ilist_t             *ilist;
+
+   // The number of consumers listening on this queue. A spsc queue allows
+   // only one.
+   uint32_t                 nconsumers;
+#ifdef DEBUG
+   pthread_t                spsc_producer;
+   uint32_t                 spsc_nproducers;
+#endif
+
+   // sync points at sync_local, unless the queue is in shared memory (see
+   // amq_message_queue_create_shm()), in which case it points into the
+   // mapping so that other processes sleep on the same words.
+   struct queue_sync_t     *sync;
+   struct queue_sync_t      sync_local;
+   void                    *shm;
+   size_t                   shm_size;
+
+   // Backpressure, see amq_queue_set_limit(). A high_water of zero means the
+   // queue is only limited by the engine's capacity. The limit can be changed
+   // while producers are posting, so these are only accessed atomically; the
+   // discard function is stored before the policy that uses it.
+   size_t                   high_water;
+   enum amq_post_policy_t   policy;
+   amq_discard_func_t      *discard_func;
+
+   // Spilling to disk, see amq_queue_set_spill(). spilled counts messages
+   // that have gone to the log and are not back in the engine yet; while it
+   // is non-zero new messages go to the log as well, so that they are taken
+   // in the order they were posted. The consumer that holds spill_refilling
+   // moves messages back, keeping one that did not fit in spill_next.
+   amq_spill_t             *spill;
+   size_t                   spill_high;
+   size_t                   spill_low;
+   amq_alloc_func_t        *spill_alloc;
+   amq_discard_func_t      *spill_release;
+   size_t                   spilled;
+   uint32_t                 spill_refilling;
+   bool                     spill_has_next;
+   struct amq_message_t     spill_next;
+   uint64_t                 spill_next_ns;
+
+   // Task consumers (see amq_task_consumer_create()) do not sleep on the
+   // queue; posting schedules them onto the executor instead. ntasks lets
+   // posters skip the lock when there are none.
+   pthread_mutex_t          tasks_lock;
+   struct worker_t         *tasks;
+   uint32_t                 ntasks;
+
+   // Multi-queue consumers (see amq_consumer_create_multi()) do not sleep on
+   // avail_seq either; posting wakes them through this list. nlisteners lets
+   // posters skip the lock when there are none.
+   pthread_mutex_t          listeners_lock;
+   struct queue_listener_t *listeners;
+   uint32_t                 nlisteners;
+
+   // Work-stealing queues keep shared messages in cmq, and give each consumer
+   // a deque of its own, claimed through deques_used. A deque outlives the
+   // consumer that owned it, so that anything left in it can still be stolen.
+   amq_deque_t             *deques[STEAL_MAX_CONSUMERS];
+   uint64_t                 deques_used;
+   uint32_t                 ndeques;
+   size_t                   deque_capacity;
+
+   // Message buffers from amq_msg_alloc().
+   amq_slab_t              *slab;
+
+   // The readiness descriptor from amq_queue_fd(), created under event_lock.
+   // event_state says whether it exists, and if so whether it is readable.
+   pthread_mutex_t          event_lock;
+   struct amq_evfd_t        evfd;
+   uint32_t                 event_state;
 };
 
-static void queue_del (struct queue_t *q)
+#define EVENT_NONE         (0)
+#define EVENT_CLEAR        (1)
+#define EVENT_SIGNALLED    (2)
+
+// The work-stealing deque owned by the consumer running on this thread, and
+// the queue that it belongs to.
+static __thread struct amq_queue_t *tl_steal_queue;
+static __thread amq_deque_t        *tl_steal_deque;
+
+static uint64_t clock_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t queue_count (struct amq_queue_t *q);
+static void queue_schedule_tasks (struct amq_queue_t *q, int32_t ntasks);
+static bool queue_trytake (struct amq_queue_t *q, void **buf, size_t *buf_len,
+                           uint64_t *posted_ns);
+
+static void queue_del (struct amq_queue_t *q)
 {
    if (!q)
       return;
    free (q->name);
-   int nmessages = cmq_count (q->cmq);
+   // Messages in a shared-memory queue belong to the other processes too.
+   size_t nmessages = (q->cmq || (q->ring && !q->shm) || q->spsc || q->ilist) ?
+                      queue_count (q) : 0;
+   nmessages += q->spilled;
    if (nmessages) {
-      fprintf (stderr, "Removing queue, discarding %i messages\n", nmessages);
+      fprintf (stderr, "Removing queue, discarding %zu messages\n", nmessages);
    }
+   if (q->spill_has_next)
+      q->spill_release (q->spill_next.mesg, q->spill_next.mesg_len);
+   amq_spill_del (q->spill);
    cmq_del (q->cmq);
+   if (q->shm)
+      munmap (q->shm, q->shm_size);
+   else
+      amq_ring_del (q->ring);
+   amq_spsc_del (q->spsc);
+   amq_ilist_del (q->ilist);
+   for (size_t i=0; i<STEAL_MAX_CONSUMERS; i++) {
+      amq_deque_del (q->deques[i]);
+   }
+   amq_slab_del (q->slab);
+   if (q->event_state != EVENT_NONE)
+      amq_evfd_close (&q->evfd);
+   pthread_mutex_destroy (&q->tasks_lock);
+   pthread_mutex_destroy (&q->listeners_lock);
+   pthread_mutex_destroy (&q->event_lock);
    free (q);
 }
 
-static struct queue_t *queue_new (const char *name)
+// Everything but the engine's storage.
+static struct amq_queue_t *queue_alloc (const char *name, enum amq_queue_engine_t engine)
 {
-   struct queue_t *ret = calloc (1, sizeof *ret);
+   struct amq_queue_t *ret = calloc (1, sizeof *ret);
    if (!ret)
       return NULL;
 
+   pthread_mutex_init (&ret->tasks_lock, NULL);
+   pthread_mutex_init (&ret->listeners_lock, NULL);
+   pthread_mutex_init (&ret->event_lock, NULL);
+   ret->evfd.rfd = ret->evfd.wfd = -1;
+   ret->refcount = 1;
+   ret->engine = engine;
    ret->name = ds_str_dup (name);
-   ret->cmq = cmq_new ();
-   if (!ret->name || !ret->cmq) {
+   ret->slab = amq_slab_new ();
+   ret->sync = &ret->sync_local;
+
+   if (!ret->name || !ret->slab) {
+      queue_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+static struct amq_queue_t *queue_new (const char *name,
+                                      enum amq_queue_engine_t engine, size_t capacity,
+                                      size_t msg_size)
+{
+   struct amq_queue_t *ret = queue_alloc (name, engine);
+   if (!ret)
+      return NULL;
+
+   switch (engine) {
+      case amq_queue_engine_CMQ:
+         ret->cmq = cmq_new ();
+         break;
+
+      case amq_queue_engine_RING:
+         ret->ring = amq_ring_new (capacity ? capacity : AMQ_QUEUE_DEFAULT_CAPACITY);
+         break;
+
+      case amq_queue_engine_SPSC:
+         ret->spsc = amq_spsc_new (capacity ? capacity : AMQ_QUEUE_DEFAULT_CAPACITY);
+         break;
+
+      case amq_queue_engine_STEAL:
+         ret->cmq = cmq_new ();
+         ret->deque_capacity = capacity ? capacity : AMQ_QUEUE_DEFAULT_CAPACITY;
+         break;
+
+      case amq_queue_engine_INTRUSIVE:
+         ret->ilist = amq_ilist_new ();
+         break;
+
+      case amq_queue_engine_INLINE:
+         ret->ring = amq_ring_new_inline (capacity ? capacity : AMQ_QUEUE_DEFAULT_CAPACITY,
+                                          msg_size ? msg_size : AMQ_QUEUE_DEFAULT_INLINE_SIZE);
+         break;
+   }
+
+   if (!ret->cmq && !ret->ring && !ret->spsc && !ret->ilist) {
       queue_del (ret);
       ret = NULL;
    }
@@ -127,301 +450,2661 @@ static struct queue_t *queue_new (const char *name)
 }
 
 /* ************************************************************
- * Statistics object, to track performance of queues
+ * Queues in shared memory. The object holds a header, with the words
+ * that both sides sleep on, followed by an inline ring. The ring holds
+ * no pointers, so it works at whatever address each process maps it.
+ * The process that creates the object sets it up and stores the magic
+ * number last; the others wait for the magic number before using it.
  */
-static void amq_stats_update (struct amq_stats_t *so, float newval)
+#define SHM_MAGIC          (0x616d712e73686d31ULL)
+#define SHM_RING_OFFSET    (((sizeof (struct shm_hdr_t) + AMQ_CACHELINE_SIZE - 1) \
+                              / AMQ_CACHELINE_SIZE) * AMQ_CACHELINE_SIZE)
+// How many times, 1ms apart, to look for a creator to finish setting up.
+#define SHM_ATTACH_TRIES   (1000)
+
+struct shm_hdr_t {
+   uint64_t             magic;
+   uint64_t             size;
+   uint64_t             msg_size;
+   struct queue_sync_t  sync;
+};
+
+static bool shm_path (char *dst, size_t len, const char *name)
+{
+   return name && name[0] && !strchr (name, '/') &&
+          snprintf (dst, len, "/amq.%s", name) < (int)len;
+}
+
+static struct amq_queue_t *queue_new_shm (const char *name, size_t capacity,
+                                          size_t msg_size)
+{
+#ifndef AMQ_FUTEX_HAVE_SHARED
+   (void)capacity;
+   (void)msg_size;
+   AMQ_ERROR_POST (ENOSYS, "Queue [%s]: shared-memory queues are not supported here\n",
+                   name);
+   return NULL;
+#else
+   char path[NAME_MAX + 1];
+   struct amq_queue_t *ret = NULL;
+   struct shm_hdr_t *hdr = MAP_FAILED;
+   size_t size = 0;
+   bool created = false;
+   int fd = -1;
+
+   capacity = capacity ? capacity : AMQ_QUEUE_DEFAULT_CAPACITY;
+   msg_size = msg_size ? msg_size : AMQ_QUEUE_DEFAULT_INLINE_SIZE;
+
+   if (!(shm_path (path, sizeof path, name))) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s]: not a valid shared-memory queue name\n", name);
+      return NULL;
+   }
+
+   if (!(ret = queue_alloc (name, amq_queue_engine_INLINE)))
+      return NULL;
+
+   if ((fd = shm_open (path, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0) {
+      created = true;
+      size = SHM_RING_OFFSET + amq_ring_inline_size (capacity, msg_size);
+      if (ftruncate (fd, size) != 0)
+         goto syserror;
+   } else if (errno == EEXIST && (fd = shm_open (path, O_RDWR, 0)) >= 0) {
+      // The creator sizes the object before anything else.
+      struct stat st = { .st_size = 0 };
+      for (size_t i=0; i<SHM_ATTACH_TRIES && st.st_size == 0; i++) {
+         if (fstat (fd, &st) != 0)
+            goto syserror;
+         if (st.st_size == 0)
+            usleep (1000);
+      }
+      size = st.st_size;
+   } else {
+      goto syserror;
+   }
+
+   if (size < SHM_RING_OFFSET) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s]: [%s] is not a message queue\n", name, path);
+      goto errorexit;
+   }
+
+   if ((hdr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+      goto syserror;
+
+   if (created) {
+      ret->ring = amq_ring_init_inline ((char *)hdr + SHM_RING_OFFSET, capacity, msg_size);
+      hdr->size = size;
+      hdr->msg_size = msg_size;
+      __atomic_store_n (&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+   } else {
+      for (size_t i=0; i<SHM_ATTACH_TRIES; i++) {
+         if (__atomic_load_n (&hdr->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC)
+            break;
+         usleep (1000);
+      }
+      if (__atomic_load_n (&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || hdr->size != size) {
+         AMQ_ERROR_POST (EINVAL, "Queue [%s]: [%s] is not a message queue\n", name, path);
+         goto errorexit;
+      }
+      if (msg_size > hdr->msg_size) {
+         AMQ_ERROR_POST (EINVAL, "Queue [%s]: existing queue holds at most %" PRIu64
+                         " bytes per message\n", name, hdr->msg_size);
+         goto errorexit;
+      }
+      ret->ring = (amq_ring_t *)((char *)hdr + SHM_RING_OFFSET);
+   }
+
+   ret->shm = hdr;
+   ret->shm_size = size;
+   ret->sync = &hdr->sync;
+   close (fd);
+   return ret;
+
+syserror:
+   AMQ_ERROR_POST (errno, "Queue [%s]: failed to map [%s]: %m\n", name, path);
+errorexit:
+   if (hdr != MAP_FAILED)
+      munmap (hdr, size);
+   if (created)
+      shm_unlink (path);
+   if (fd >= 0)
+      close (fd);
+   ret->ring = NULL;
+   queue_del (ret);
+   return NULL;
+#endif
+}
+
+static struct amq_queue_t *queue_ref (struct amq_queue_t *q)
+{
+   if (q)
+      __atomic_add_fetch (&q->refcount, 1, __ATOMIC_RELAXED);
+   return q;
+}
+
+static void queue_unref (struct amq_queue_t *q)
+{
+   if (!q)
+      return;
+
+   if ((__atomic_sub_fetch (&q->refcount, 1, __ATOMIC_ACQ_REL))==0)
+      queue_del (q);
+}
+
+// Consumers attach to the queue they listen on, which also keeps the queue
+// alive for as long as the consumer exists.
+static bool queue_attach (struct amq_queue_t *q)
+{
+   if (q->engine == amq_queue_engine_SPSC) {
+      uint32_t expected = 0;
+      if (!(__atomic_compare_exchange_n (&q->nconsumers, &expected, 1, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)))
+         return false;
+   } else {
+      __atomic_add_fetch (&q->nconsumers, 1, __ATOMIC_RELAXED);
+   }
+
+   queue_ref (q);
+   return true;
+}
+
+static void queue_detach (struct amq_queue_t *q)
+{
+   if (!q)
+      return;
+
+   __atomic_sub_fetch (&q->nconsumers, 1, __ATOMIC_RELEASE);
+   queue_unref (q);
+}
+
+// Claim a deque of a work-stealing queue for a new consumer. Returns the index
+// of the deque, or -1 if all of them are in use. A deque is reused by the next
+// consumer to claim its index, together with any messages still in it.
+static int queue_claim_deque (struct amq_queue_t *q)
+{
+   uint64_t used = __atomic_load_n (&q->deques_used, __ATOMIC_RELAXED);
+
+   for (;;) {
+      if (used == UINT64_MAX)
+         return -1;
+
+      int index = __builtin_ctzll (~used);
+      if ((__atomic_compare_exchange_n (&q->deques_used, &used, used | (1ULL << index),
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))) {
+         if (!q->deques[index]) {
+            amq_deque_t *deque = amq_deque_new (q->deque_capacity);
+            if (!deque) {
+               __atomic_fetch_and (&q->deques_used, ~(1ULL << index), __ATOMIC_RELEASE);
+               return -1;
+            }
+            __atomic_store_n (&q->deques[index], deque, __ATOMIC_RELEASE);
+         }
+
+         uint32_t ndeques = __atomic_load_n (&q->ndeques, __ATOMIC_RELAXED);
+         while (ndeques < (uint32_t)index + 1 &&
+                !(__atomic_compare_exchange_n (&q->ndeques, &ndeques, index + 1, true,
+                                               __ATOMIC_RELEASE, __ATOMIC_RELAXED)))
+            ;
+         return index;
+      }
+   }
+}
+
+static void queue_release_deque (struct amq_queue_t *q, int index)
+{
+   __atomic_fetch_and (&q->deques_used, ~(1ULL << index), __ATOMIC_RELEASE);
+}
+
+// Returns the deque that the calling thread owns in q, if it owns one.
+static amq_deque_t *queue_local_deque (struct amq_queue_t *q)
+{
+   return tl_steal_queue == q ? tl_steal_deque : NULL;
+}
+
+// Steal the oldest message from the deque of another consumer of a
+// work-stealing queue. local is the caller's own deque, if it has one.
+static bool queue_steal (struct amq_queue_t *q, amq_deque_t *local,
+                         void **buf, size_t *buf_len, uint64_t *posted_ns)
+{
+   uint32_t ndeques = __atomic_load_n (&q->ndeques, __ATOMIC_ACQUIRE);
+   // Threads start looking at different deques so that thieves spread out.
+   uint32_t start = ndeques ? (uint32_t)((uintptr_t)&local >> 6) % ndeques : 0;
+
+   for (uint32_t i=0; i<ndeques; i++) {
+      amq_deque_t *deque = __atomic_load_n (&q->deques[(start + i) % ndeques],
+                                            __ATOMIC_ACQUIRE);
+      if (deque && deque != local && amq_deque_steal (deque, buf, buf_len, posted_ns))
+         return true;
+   }
+
+   return false;
+}
+
+static size_t queue_capacity (struct amq_queue_t *q)
+{
+   switch (q->engine) {
+      case amq_queue_engine_CMQ:    return SIZE_MAX;
+      case amq_queue_engine_RING:
+      case amq_queue_engine_INLINE: return amq_ring_capacity (q->ring);
+      case amq_queue_engine_SPSC:   return amq_spsc_capacity (q->spsc);
+      case amq_queue_engine_STEAL:  return SIZE_MAX;
+      case amq_queue_engine_INTRUSIVE: return SIZE_MAX;
+   }
+   return SIZE_MAX;
+}
+
+// Messages in the spill log do not count: the consumer that moves them back
+// wakes the others once they are in the engine (see queue_sleep_timeout()).
+static bool queue_has_messages (struct amq_queue_t *q)
+{
+   return queue_count (q) > 0;
+}
+
+// How long, at most, a consumer sleeps on an empty queue while messages are in
+// the spill log, so that it tries to read them back itself if the consumer that
+// was doing so gave up.
+#define SPILL_RETRY_US     (10 * 1000)
+
+static size_t queue_sleep_timeout (struct amq_queue_t *q, size_t timeout_us)
+{
+   if (timeout_us > SPILL_RETRY_US && __atomic_load_n (&q->spilled, __ATOMIC_RELAXED))
+      return SPILL_RETRY_US;
+   return timeout_us;
+}
+
+// The limit is the lower of the engine's capacity and the high-water mark set
+// with amq_queue_set_limit().
+static size_t queue_limit (struct amq_queue_t *q)
 {
-   if (newval < so->min)
-      so->min = newval;
+   size_t capacity = queue_capacity (q);
+   size_t high_water = __atomic_load_n (&q->high_water, __ATOMIC_RELAXED);
+   return high_water && high_water < capacity ? high_water : capacity;
+}
 
-   if (newval > so->max)
-      so->max = newval;
+static bool queue_has_space (struct amq_queue_t *q)
+{
+   // Slots that consumers have taken but not yet released are not counted, so
+   // an inline ring can be full with fewer than capacity messages in it.
+   if (q->engine == amq_queue_engine_INLINE && !(amq_ring_writable (q->ring)))
+      return false;
 
-   so->count++;
+   return queue_count (q) < queue_limit (q);
+}
 
-   so->average = (so->average + newval) / so->count;
+// The sync words of a shared-memory queue are slept on by other processes too.
+static bool queue_futex_wait (struct amq_queue_t *q, uint32_t *seq, uint32_t expected,
+                              size_t timeout_us)
+{
+   return q->shm ? amq_futex_wait_shared (seq, expected, timeout_us)
+                 : amq_futex_wait (seq, expected, timeout_us);
+}
 
-   float tmp = newval - so->average;
-   if (tmp < 0)
-      tmp *= -1;
+static void queue_futex_wake (struct amq_queue_t *q, uint32_t *seq, int32_t nwaiters)
+{
+   if (q->shm)
+      amq_futex_wake_shared (seq, nwaiters);
+   else
+      amq_futex_wake (seq, nwaiters);
+}
 
-   so->deviation = (so->deviation + tmp) / so->count;
+// Wake sleepers on one side of the queue, if there are any. The fence pairs
+// with the one in queue_sleep() so that either the sleeper sees the change
+// that was just made to the queue, or we see the sleeper.
+static void queue_wake (struct amq_queue_t *q, uint32_t *seq, uint32_t *waiting,
+                        int32_t nwaiters)
+{
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+   if (__atomic_load_n (waiting, __ATOMIC_RELAXED)) {
+      __atomic_add_fetch (seq, 1, __ATOMIC_RELEASE);
+      queue_futex_wake (q, seq, nwaiters);
+   }
 }
 
-static float timespec_conv (const struct timespec *ts)
+// The worker signals that interrupt a consumer blocked on its queue.
+#define WORKER_INTERRUPT_SIGNALS    (AMQ_SIGNAL_TERMINATE | AMQ_SIGNAL_SUSPEND)
+
+// Returns true if the worker whose flags are given must stop waiting. flags
+// may be NULL when the caller is not a worker.
+static bool queue_interrupted (const uint64_t *flags)
 {
-   float ret = 0;
-   ret = ts->tv_sec * 1000000000;
-   ret += ts->tv_nsec;
+   return flags && (__atomic_load_n (flags, __ATOMIC_SEQ_CST) & WORKER_INTERRUPT_SIGNALS);
+}
 
-   ret = ret / 1000000;
+// Sleep on one side of the queue until woken or timed out. The caller must retry
+// its operation after this returns, and must call this in a loop. The flags are
+// checked after the sequence is read, so a signal that is raised and followed by
+// queue_interrupt() cannot be missed.
+static bool queue_sleep (uint32_t *seq, uint32_t *waiting, size_t timeout_us,
+                         bool (*ready) (struct amq_queue_t *), struct amq_queue_t *q,
+                         const uint64_t *flags)
+{
+   uint32_t current = __atomic_load_n (seq, __ATOMIC_ACQUIRE);
+   __atomic_add_fetch (waiting, 1, __ATOMIC_SEQ_CST);
+
+   bool ret = true;
+   if (!ready (q) && !queue_interrupted (flags)) {
+      // Hand back any message buffers that were released by this thread
+      // before going to sleep, rather than holding on to them.
+      amq_slab_flush ();
+      ret = queue_futex_wait (q, seq, current, timeout_us);
+   }
 
+   __atomic_sub_fetch (waiting, 1, __ATOMIC_RELAXED);
    return ret;
 }
 
-/* ************************************************************
- * Worker objects, so we can keep track of workers
- */
+static void queue_add_listener (struct amq_queue_t *q, struct queue_listener_t *listener)
+{
+   pthread_mutex_lock (&q->listeners_lock);
+   listener->next = q->listeners;
+   q->listeners = listener;
+   __atomic_add_fetch (&q->nlisteners, 1, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock (&q->listeners_lock);
+}
 
-#define WORKER_ERROR          (0)
-#define WORKER_PRODUCER       (1)
-#define WORKER_CONSUMER       (2)
-union worker_func_t {
-   amq_producer_func_t *producer_func;
-   amq_consumer_func_t *consumer_func;
-};
+static void queue_remove_listener (struct amq_queue_t *q, struct queue_listener_t *listener)
+{
+   pthread_mutex_lock (&q->listeners_lock);
+   for (struct queue_listener_t **l=&q->listeners; *l; l=&(*l)->next) {
+      if (*l == listener) {
+         *l = listener->next;
+         __atomic_sub_fetch (&q->nlisteners, 1, __ATOMIC_RELAXED);
+         break;
+      }
+   }
+   pthread_mutex_unlock (&q->listeners_lock);
+}
 
-struct worker_t {
-   // The following fields cannot be added to, removed from or swapped in order
-   // as they are public to the caller.
-   pthread_t             worker_id;
-   char                 *worker_name;
-   void                 *worker_cdata;
-   uint8_t               worker_type;
-   struct amq_stats_t    stats;
+// Wake up to nwaiters of the multi-queue consumers that are asleep; the ones
+// that are busy will look at this queue before they next sleep.
+static void queue_wake_listeners (struct amq_queue_t *q, int32_t nwaiters)
+{
+   pthread_mutex_lock (&q->listeners_lock);
+   for (struct queue_listener_t *l=q->listeners; l && nwaiters > 0; l=l->next) {
+      if (__atomic_load_n (l->waiting, __ATOMIC_RELAXED)) {
+         __atomic_add_fetch (l->seq, 1, __ATOMIC_RELEASE);
+         amq_futex_wake (l->seq, 1);
+         nwaiters--;
+      }
+   }
+   pthread_mutex_unlock (&q->listeners_lock);
+}
 
-   // These fields are private.
-   cmq_t                *listen_queue;
-   union worker_func_t   worker_func;
-   pthread_mutex_t       flags_lock;
-   uint64_t              flags;
-};
+// Make the readiness descriptor readable, unless it already is.
+static void queue_event_signal (struct amq_queue_t *q)
+{
+   uint32_t expected = EVENT_CLEAR;
+   if (__atomic_compare_exchange_n (&q->event_state, &expected, EVENT_SIGNALLED, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      amq_evfd_signal (&q->evfd);
+}
 
-static void worker_del (struct worker_t *w)
+// Make the readiness descriptor unreadable once the queue has been found empty.
+// The descriptor is drained before the state is cleared, so that a signal from
+// a post that sees the cleared state is not drained with it; a post that still
+// saw the old state did not signal, and is caught by checking the queue again.
+static void queue_event_clear (struct amq_queue_t *q)
 {
-   if (!w)
+   if (__atomic_load_n (&q->event_state, __ATOMIC_RELAXED) != EVENT_SIGNALLED)
       return;
 
-   amq_worker_sigset (w->worker_name, AMQ_SIGNAL_TERMINATE);
-   amq_worker_wait (w->worker_name);
-   free (w->worker_name);
-   pthread_mutex_destroy (&w->flags_lock);
-   memset (w, 0, sizeof *w);
-   free (w);
+   amq_evfd_clear (&q->evfd);
+
+   uint32_t expected = EVENT_SIGNALLED;
+   if ((__atomic_compare_exchange_n (&q->event_state, &expected, EVENT_CLEAR, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) &&
+       queue_has_messages (q))
+      queue_event_signal (q);
 }
 
-static struct worker_t *worker_new (const char *name, cmq_t *listen_queue, uint8_t type,
-                                    void *worker_func, void *cdata)
+// Returns the readiness descriptor of the queue, creating it if needed. Inline
+// queues cannot be taken from with amq_try_take(), so nothing would ever make
+// their descriptor unreadable again.
+static int queue_event_fd (struct amq_queue_t *q)
 {
-   struct worker_t *ret = calloc (1, sizeof *ret);
-   if (!ret)
-      return NULL;
+   int ret = -1;
 
-   pthread_mutexattr_t attr;
-   pthread_mutexattr_init (&attr);
-   pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+   if (q->engine == amq_queue_engine_INLINE) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s]: inline queues have no descriptor\n", q->name);
+      return -1;
+   }
 
-   ret->listen_queue = listen_queue;
-   ret->worker_type = type;
-   ret->worker_cdata = cdata;
-   pthread_mutex_init (&ret->flags_lock, &attr);
-   pthread_mutexattr_destroy (&attr);
+   pthread_mutex_lock (&q->event_lock);
 
-   ret->worker_name = ds_str_dup (name);
+   if (q->event_state == EVENT_NONE) {
+      if (!(amq_evfd_open (&q->evfd))) {
+         AMQ_ERROR_POST (-1, "Failed to create a descriptor for queue [%s]: %m\n", q->name);
+         goto errorexit;
+      }
+      __atomic_store_n (&q->event_state, EVENT_CLEAR, __ATOMIC_SEQ_CST);
+      if (queue_has_messages (q))
+         queue_event_signal (q);
+   }
+   ret = q->evfd.rfd;
 
-   if (type==WORKER_PRODUCER)
-      ret->worker_func.producer_func = worker_func;
+errorexit:
+   pthread_mutex_unlock (&q->event_lock);
+   return ret;
+}
+
+// Tell consumers that nmesgs messages have been posted: wake sleeping consumers,
+// and schedule idle task consumers.
+static void queue_notify (struct amq_queue_t *q, size_t nmesgs)
+{
+   int32_t n = nmesgs > INT32_MAX ? INT32_MAX : (int32_t)nmesgs;
+
+   // queue_wake() has the fence that orders the post before the loads of
+   // ntasks and nlisteners.
+   queue_wake (q, &q->sync->avail_seq, &q->sync->avail_waiting, n);
+   if (__atomic_load_n (&q->ntasks, __ATOMIC_RELAXED))
+      queue_schedule_tasks (q, n);
+   if (__atomic_load_n (&q->nlisteners, __ATOMIC_RELAXED))
+      queue_wake_listeners (q, n);
+   if (__atomic_load_n (&q->event_state, __ATOMIC_RELAXED) == EVENT_CLEAR)
+      queue_event_signal (q);
+}
+
+// Wake every consumer sleeping on the queue so that they re-check their signals.
+// Consumers that were not signalled go back to sleep.
+static void queue_interrupt (struct amq_queue_t *q)
+{
+   __atomic_add_fetch (&q->sync->avail_seq, 1, __ATOMIC_SEQ_CST);
+   queue_futex_wake (q, &q->sync->avail_seq, AMQ_FUTEX_ALL);
+}
+
+#ifdef DEBUG
+// Debug builds complain when a single-producer queue sees a second thread post
+// to it. Release builds trust the caller.
+static void spsc_check_producer (struct amq_queue_t *q)
+{
+   pthread_t self = pthread_self ();
+   if (__atomic_load_n (&q->spsc_nproducers, __ATOMIC_ACQUIRE) == 0) {
+      q->spsc_producer = self;
+      __atomic_store_n (&q->spsc_nproducers, 1, __ATOMIC_RELEASE);
+      return;
+   }
+   if (!(pthread_equal (q->spsc_producer, self)) &&
+       __atomic_add_fetch (&q->spsc_nproducers, 1, __ATOMIC_RELAXED) == 2) {
+      AMQ_ERROR_POST (-1, "Queue [%s] is single-producer but is posted to by more "
+                          "than one thread\n", q->name);
+   }
+}
+#endif
+
+// Once a queue is over its spill mark, messages are copied to the end of the
+// spill log and the caller's buffer is released. A consumer that finds the
+// queue drained to the low-water mark reads them back, in order, into buffers
+// from the queue's alloc function and posts them to the engine until it is back
+// at the mark.
+//
+// Returns false if the message must be posted to the engine as usual: the
+// queue does not spill, the message has no length, the queue is under its
+// spill mark with nothing in the log, or the log could not be written.
+static bool queue_spill (struct amq_queue_t *q, void *buf, size_t buf_len,
+                         uint64_t posted_ns)
+{
+   amq_spill_t *spill = __atomic_load_n (&q->spill, __ATOMIC_ACQUIRE);
+   if (!spill || !buf_len)
+      return false;
+
+   if (!__atomic_load_n (&q->spilled, __ATOMIC_ACQUIRE) && queue_count (q) < q->spill_high)
+      return false;
+
+   // Counted first, so that the messages posted after this one are spilled too.
+   __atomic_add_fetch (&q->spilled, 1, __ATOMIC_SEQ_CST);
+   if (!(amq_spill_append (spill, buf, buf_len, posted_ns))) {
+      __atomic_sub_fetch (&q->spilled, 1, __ATOMIC_SEQ_CST);
+      AMQ_ERROR_POST (errno, "Queue [%s]: failed to spill a message to disk: %m\n",
+                      q->name);
+      return false;
+   }
+
+   q->spill_release (buf, buf_len);
+   return true;
+}
+
+static void *queue_spill_alloc (void *cdata, size_t len)
+{
+   struct amq_queue_t *q = cdata;
+   return q->spill_alloc (q->name, len);
+}
+
+// Spilling queues are limited to the engines that take a pointer from any
+// thread without a limit of their own, see amq_queue_set_spill().
+static bool queue_unspill_push (struct amq_queue_t *q)
+{
+   struct amq_message_t *m = &q->spill_next;
+
+   if (q->engine == amq_queue_engine_RING)
+      return amq_ring_push (q->ring, m->mesg, m->mesg_len, q->spill_next_ns);
+
+   return cmq_post (q->cmq, m->mesg, m->mesg_len);
+}
+
+// Only one consumer reads the log back at a time; the others carry on taking
+// whatever is already in the engine.
+static void queue_unspill (struct amq_queue_t *q)
+{
+   size_t n = 0;
+
+   if (!__atomic_load_n (&q->spilled, __ATOMIC_ACQUIRE) || queue_count (q) > q->spill_low)
+      return;
+
+   if (__atomic_exchange_n (&q->spill_refilling, 1, __ATOMIC_ACQUIRE))
+      return;
+
+   while (queue_count (q) < q->spill_high) {
+      if (!q->spill_has_next) {
+         if (!(amq_spill_read (q->spill, queue_spill_alloc, q, &q->spill_next.mesg,
+                               &q->spill_next.mesg_len, &q->spill_next_ns))) {
+            // The log only runs dry when a post has counted a message that it
+            // has not finished appending.
+            if (amq_spill_count (q->spill))
+               AMQ_ERROR_POST (errno, "Queue [%s]: failed to read a spilled message "
+                                      "back from disk: %m\n", q->name);
+            break;
+         }
+         q->spill_has_next = true;
+      }
+      if (!(queue_unspill_push (q)))
+         break;
+      q->spill_has_next = false;
+      __atomic_sub_fetch (&q->spilled, 1, __ATOMIC_SEQ_CST);
+      n++;
+   }
+
+   __atomic_store_n (&q->spill_refilling, 0, __ATOMIC_RELEASE);
+   if (n)
+      queue_notify (q, n);
+}
+
+// cmq is never full, but posting to it allocates, so it can fail.
+static enum amq_post_result_t queue_post_cmq (struct amq_queue_t *q, void *buf,
+                                              size_t buf_len)
+{
+   if (cmq_post (q->cmq, buf, buf_len))
+      return amq_post_result_OK;
+
+   AMQ_ERROR_POST (-1, "Queue [%s]: failed to post a message\n", q->name);
+   return amq_post_result_ERROR;
+}
+
+static enum amq_post_result_t queue_post_bounded (bool posted)
+{
+   return posted ? amq_post_result_OK : amq_post_result_FULL;
+}
+
+// Returns amq_post_result_FULL if the queue is full, or amq_post_result_ERROR
+// if the message could not be queued at all; in both cases the caller still
+// owns the message. The high-water mark is checked before posting, so
+// concurrent producers can overshoot it slightly; the capacity of a bounded
+// engine is never exceeded.
+static enum amq_post_result_t queue_trypost (struct amq_queue_t *q, void *buf,
+                                             size_t buf_len, uint64_t posted_ns)
+{
+   if (queue_spill (q, buf, buf_len, posted_ns))
+      return amq_post_result_OK;
+
+   size_t high_water = __atomic_load_n (&q->high_water, __ATOMIC_RELAXED);
+   if (high_water && queue_count (q) >= high_water)
+      return amq_post_result_FULL;
+
+   switch (q->engine) {
+      case amq_queue_engine_CMQ:
+         return queue_post_cmq (q, buf, buf_len);
+
+      case amq_queue_engine_RING:
+         return queue_post_bounded (amq_ring_push (q->ring, buf, buf_len, posted_ns));
+
+      case amq_queue_engine_INLINE:
+         return queue_post_bounded (amq_ring_push_copy (q->ring, buf, buf_len,
+                                                        posted_ns));
+
+      case amq_queue_engine_SPSC:
+#ifdef DEBUG
+         spsc_check_producer (q);
+#endif
+         return queue_post_bounded (amq_spsc_push (q->spsc, buf, buf_len, posted_ns));
+
+      case amq_queue_engine_STEAL: {
+         // Posts made by one of the queue's own consumers stay on its deque
+         // unless the deque is full.
+         amq_deque_t *local = queue_local_deque (q);
+         if (local && amq_deque_push (local, buf, buf_len, posted_ns))
+            return amq_post_result_OK;
+         return queue_post_cmq (q, buf, buf_len);
+      }
+
+      case amq_queue_engine_INTRUSIVE:
+         return queue_post_bounded (amq_ilist_push (q->ilist, buf, buf_len, posted_ns));
+   }
+
+   return amq_post_result_ERROR;
+}
+
+// Returns the number of messages posted, which is less than nbufs if the queue
+// fills up, or if a message could not be queued at all, in which case failed is
+// set and the caller still owns that message and the ones after it.
+static size_t queue_trypost_many (struct amq_queue_t *q, void **bufs, size_t *buf_lens,
+                                  size_t nbufs, uint64_t posted_ns, bool *failed)
+{
+   enum amq_post_result_t rc = amq_post_result_OK;
+   size_t ret = 0;
+
+   // Each message may or may not have to be spilled.
+   if (__atomic_load_n (&q->spill, __ATOMIC_ACQUIRE)) {
+      while (ret < nbufs &&
+             (rc = queue_trypost (q, bufs[ret], buf_lens ? buf_lens[ret] : 0,
+                                  posted_ns)) == amq_post_result_OK) {
+         ret++;
+      }
+      *failed = rc == amq_post_result_ERROR;
+      return ret;
+   }
+
+   size_t high_water = __atomic_load_n (&q->high_water, __ATOMIC_RELAXED);
+   if (high_water) {
+      size_t count = queue_count (q);
+      if (count >= high_water)
+         return 0;
+      if (nbufs > high_water - count)
+         nbufs = high_water - count;
+   }
+
+   switch (q->engine) {
+      case amq_queue_engine_CMQ:
+         while (ret < nbufs &&
+                (rc = queue_post_cmq (q, bufs[ret], buf_lens ? buf_lens[ret] : 0))
+                   == amq_post_result_OK) {
+            ret++;
+         }
+         *failed = rc == amq_post_result_ERROR;
+         return ret;
+
+      case amq_queue_engine_RING:
+         return amq_ring_push_many (q->ring, bufs, buf_lens, posted_ns, nbufs);
+
+      case amq_queue_engine_SPSC:
+#ifdef DEBUG
+         spsc_check_producer (q);
+#endif
+         return amq_spsc_push_many (q->spsc, bufs, buf_lens, posted_ns, nbufs);
+
+      case amq_queue_engine_STEAL: {
+         amq_deque_t *local = queue_local_deque (q);
+         for (; ret<nbufs; ret++) {
+            size_t buf_len = buf_lens ? buf_lens[ret] : 0;
+            if (local && amq_deque_push (local, bufs[ret], buf_len, posted_ns))
+               continue;
+            if (queue_post_cmq (q, bufs[ret], buf_len) != amq_post_result_OK) {
+               *failed = true;
+               break;
+            }
+         }
+         return ret;
+      }
+
+      case amq_queue_engine_INTRUSIVE:
+         return amq_ilist_push_many (q->ilist, bufs, buf_lens, posted_ns, nbufs);
+
+      case amq_queue_engine_INLINE:
+         return 0;
+   }
+
+   return 0;
+}
+
+// An intrusive queue links messages through their headers, so it cannot take
+// a NULL message.
+static bool queue_rejects (struct amq_queue_t *q, void *buf)
+{
+   return !buf && q->engine == amq_queue_engine_INTRUSIVE;
+}
+
+// Messages are copied into an inline queue by amq_post_copy(); it cannot take
+// ownership of a pointer.
+static bool queue_is_inline (struct amq_queue_t *q)
+{
+   return q->engine == amq_queue_engine_INLINE;
+}
+
+// Called once a consumer is done with a message. An inline queue keeps the
+// message's slot until then, so this is where its space is freed.
+static void queue_release (struct amq_queue_t *q, void *buf)
+{
+   if (!(queue_is_inline (q)))
+      return;
+
+   amq_ring_release (q->ring, buf);
+   queue_wake (q, &q->sync->space_seq, &q->sync->space_waiting, 1);
+}
+
+static void queue_discard (struct amq_queue_t *q, void *buf, size_t buf_len)
+{
+   amq_discard_func_t *discard_func = __atomic_load_n (&q->discard_func, __ATOMIC_ACQUIRE);
+   if (discard_func)
+      discard_func (buf, buf_len);
+}
+
+// Drop the oldest message in the queue to make space. Returns false if there
+// was nothing to drop. A message in an inline queue is in the queue's own
+// storage, so the discard function cannot be given it.
+static bool queue_drop_oldest (struct amq_queue_t *q)
+{
+   void *buf = NULL;
+   size_t buf_len = 0;
+   uint64_t posted_ns = 0;
+
+   if (!(queue_trytake (q, &buf, &buf_len, &posted_ns)))
+      return false;
+
+   if (!(queue_is_inline (q)))
+      queue_discard (q, buf, buf_len);
+   queue_release (q, buf);
+   return true;
+}
+
+// Post, waiting at most timeout_us for space. A timeout of zero does not wait
+// at all.
+static enum amq_post_result_t queue_post_timed (struct amq_queue_t *q,
+                                                void *buf, size_t buf_len,
+                                                size_t timeout_us)
+{
+   uint64_t now = clock_ns ();
+   uint64_t deadline = timeout_us == AMQ_FUTEX_FOREVER
+                     ? UINT64_MAX
+                     : now + (uint64_t)timeout_us * 1000;
+
+   if (queue_rejects (q, buf))
+      return amq_post_result_ERROR;
+
+   enum amq_post_result_t rc;
+   while ((rc = queue_trypost (q, buf, buf_len, now)) != amq_post_result_OK) {
+      if (rc == amq_post_result_ERROR)
+         return rc;
+
+      uint64_t current = clock_ns ();
+      if (current >= deadline)
+         return timeout_us ? amq_post_result_TIMEOUT : amq_post_result_FULL;
+
+      queue_sleep (&q->sync->space_seq, &q->sync->space_waiting,
+                   timeout_us == AMQ_FUTEX_FOREVER ? AMQ_FUTEX_FOREVER
+                                                   : (deadline - current) / 1000,
+                   queue_has_space, q, NULL);
+   }
+   queue_notify (q, 1);
+
+   return amq_post_result_OK;
+}
+
+// Post according to the queue's policy for a full queue.
+static enum amq_post_result_t queue_post (struct amq_queue_t *q,
+                                          void *buf, size_t buf_len)
+{
+   enum amq_post_result_t ret = amq_post_result_OK;
+
+   switch (__atomic_load_n (&q->policy, __ATOMIC_ACQUIRE)) {
+      case amq_post_policy_BLOCK:
+         return queue_post_timed (q, buf, buf_len, AMQ_FUTEX_FOREVER);
+
+      case amq_post_policy_FAIL:
+         return queue_post_timed (q, buf, buf_len, 0);
+
+      case amq_post_policy_DROP_NEWEST:
+         if ((ret = queue_post_timed (q, buf, buf_len, 0)) == amq_post_result_FULL) {
+            // The caller still owns a message that was to be copied in.
+            if (!(queue_is_inline (q)))
+               queue_discard (q, buf, buf_len);
+            ret = amq_post_result_DROPPED;
+         }
+         return ret;
+
+      case amq_post_policy_DROP_OLDEST:
+         while ((ret = queue_post_timed (q, buf, buf_len, 0)) == amq_post_result_FULL) {
+            if (!(queue_drop_oldest (q)))
+               queue_sleep (&q->sync->space_seq, &q->sync->space_waiting, 1000,
+                            queue_has_space, q, NULL);
+         }
+         return ret;
+   }
+
+   return amq_post_result_ERROR;
+}
+
+// Consumers are woken after every run of messages that is posted, and not only
+// at the end, otherwise a producer waiting for space could wait forever.
+// Returns the number of messages that were posted; see amq_post_many() for what
+// happens to the rest.
+static size_t queue_post_many (struct amq_queue_t *q, void **bufs, size_t *buf_lens,
+                               size_t nbufs)
+{
+   uint64_t now = clock_ns ();
+   size_t nposted = 0;
+   bool failed = false;
+
+   while (nposted < nbufs) {
+      size_t n = queue_trypost_many (q, &bufs[nposted],
+                                     buf_lens ? &buf_lens[nposted] : NULL,
+                                     nbufs - nposted, now, &failed);
+      if (n) {
+         nposted += n;
+         queue_notify (q, n);
+      }
+      if (failed)
+         return nposted;
+      if (n)
+         continue;
+
+      if (queue_rejects (q, bufs[nposted]))
+         return nposted;
+
+      switch (__atomic_load_n (&q->policy, __ATOMIC_ACQUIRE)) {
+         case amq_post_policy_BLOCK:
+            queue_sleep (&q->sync->space_seq, &q->sync->space_waiting, AMQ_FUTEX_FOREVER,
+                         queue_has_space, q, NULL);
+            break;
+
+         case amq_post_policy_FAIL:
+            return nposted;
+
+         case amq_post_policy_DROP_NEWEST:
+            for (size_t i=nposted; i<nbufs; i++) {
+               queue_discard (q, bufs[i], buf_lens ? buf_lens[i] : 0);
+            }
+            return nposted;
+
+         case amq_post_policy_DROP_OLDEST:
+            if (!(queue_drop_oldest (q)))
+               queue_sleep (&q->sync->space_seq, &q->sync->space_waiting, 1000,
+                            queue_has_space, q, NULL);
+            break;
+      }
+   }
+
+   return nposted;
+}
+
+// Removes a single message without blocking. Returns false if the queue is
+// empty. posted_ns is set to the time at which the message was posted.
+static bool queue_cmq_take (struct amq_queue_t *q, void **buf, size_t *buf_len,
+                            uint64_t *posted_ns)
+{
+   struct timespec ts;
+   if (!(cmq_wait (q->cmq, buf, buf_len, 0, &ts)))
+      return false;
+
+   *posted_ns = clock_ns () - ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+   return true;
+}
+
+static bool queue_trytake (struct amq_queue_t *q, void **buf, size_t *buf_len,
+                           uint64_t *posted_ns)
+{
+   bool ret = false;
+
+   if (__atomic_load_n (&q->spill, __ATOMIC_ACQUIRE))
+      queue_unspill (q);
+
+   switch (q->engine) {
+      case amq_queue_engine_CMQ:
+         ret = queue_cmq_take (q, buf, buf_len, posted_ns);
+         break;
+
+      case amq_queue_engine_STEAL: {
+         // A consumer works through its own deque first, then takes shared
+         // work, and only steals from the other consumers when there is none.
+         amq_deque_t *local = queue_local_deque (q);
+         ret = (local && amq_deque_pop (local, buf, buf_len, posted_ns))
+            || queue_cmq_take (q, buf, buf_len, posted_ns)
+            || queue_steal (q, local, buf, buf_len, posted_ns);
+         break;
+      }
+
+      case amq_queue_engine_RING:
+      case amq_queue_engine_INLINE:
+         ret = amq_ring_pop (q->ring, buf, buf_len, posted_ns);
+         break;
+
+      case amq_queue_engine_SPSC:
+         ret = amq_spsc_pop (q->spsc, buf, buf_len, posted_ns);
+         break;
+
+      case amq_queue_engine_INTRUSIVE:
+         ret = amq_ilist_pop (q->ilist, buf, buf_len, posted_ns);
+         break;
+   }
+
+   if (ret)
+      queue_wake (q, &q->sync->space_seq, &q->sync->space_waiting, 1);
+
+   return ret;
+}
+
+// Removes up to nmesgs messages without blocking, and returns the number
+// removed. The bounded engines claim the whole run of messages at once.
+static size_t queue_trytake_many (struct amq_queue_t *q, struct amq_message_t *mesgs,
+                                  uint64_t *posted_ns, size_t nmesgs)
+{
+   size_t ret = 0;
+
+   if (!nmesgs)
+      return 0;
+
+   if (__atomic_load_n (&q->spill, __ATOMIC_ACQUIRE))
+      queue_unspill (q);
+
+   switch (q->engine) {
+      case amq_queue_engine_CMQ:
+      case amq_queue_engine_STEAL:
+         while (ret < nmesgs && queue_trytake (q, &mesgs[ret].mesg,
+                                                  &mesgs[ret].mesg_len,
+                                                  &posted_ns[ret])) {
+            ret++;
+         }
+         return ret;
+
+      case amq_queue_engine_RING:
+      case amq_queue_engine_INLINE:
+         ret = amq_ring_pop_many (q->ring, mesgs, posted_ns, nmesgs);
+         break;
+
+      case amq_queue_engine_SPSC:
+         ret = amq_spsc_pop_many (q->spsc, mesgs, posted_ns, nmesgs);
+         break;
+
+      case amq_queue_engine_INTRUSIVE:
+         ret = amq_ilist_pop_many (q->ilist, mesgs, posted_ns, nmesgs);
+         break;
+   }
+
+   if (ret)
+      queue_wake (q, &q->sync->space_seq, &q->sync->space_waiting, AMQ_FUTEX_ALL);
+
+   return ret;
+}
+
+// Removes a single message, waiting for at most timeout_us microseconds for one
+// to be posted. Returns false if the timeout expired with the queue still empty,
+// or if the worker owning flags was interrupted (see queue_interrupted()).
+static bool queue_wait (struct amq_queue_t *q, void **buf, size_t *buf_len,
+                        size_t timeout_us, uint64_t *posted_ns, const uint64_t *flags)
+{
+   while (!(queue_trytake (q, buf, buf_len, posted_ns))) {
+      if (queue_interrupted (flags))
+         return false;
+      size_t sleep_us = queue_sleep_timeout (q, timeout_us);
+      if (!(queue_sleep (&q->sync->avail_seq, &q->sync->avail_waiting, sleep_us,
+                         queue_has_messages, q, flags))) {
+         if (sleep_us == timeout_us)
+            return queue_trytake (q, buf, buf_len, posted_ns);
+         if (timeout_us != AMQ_FUTEX_FOREVER)
+            timeout_us -= sleep_us;
+      }
+   }
+
+   return true;
+}
+
+// Takes a message for a caller that is not a consumer worker; see amq_try_take().
+static bool queue_try_take (struct amq_queue_t *q, void **buf, size_t *buf_len)
+{
+   size_t len = 0;
+   uint64_t posted_ns = 0;
+
+   if (queue_is_inline (q))
+      return false;
+
+   if (queue_trytake (q, buf, buf_len ? buf_len : &len, &posted_ns))
+      return true;
+
+   // Finding the queue empty is as close as an event loop gets to going to
+   // sleep, so hand back released message buffers here, as consumers do.
+   amq_slab_flush ();
+   queue_event_clear (q);
+   return false;
+}
+
+// Waits up to timeout_us for a first message, then keeps collecting messages
+// until nmesgs have been collected or max_wait_us has passed since the first
+// message arrived. Returns the number of messages collected.
+static size_t queue_wait_many (struct amq_queue_t *q, struct amq_message_t *mesgs,
+                               uint64_t *posted_ns, size_t nmesgs,
+                               size_t timeout_us, size_t max_wait_us,
+                               const uint64_t *flags)
+{
+   if (!(queue_wait (q, &mesgs[0].mesg, &mesgs[0].mesg_len, timeout_us, &posted_ns[0],
+                     flags)))
+      return 0;
+
+   size_t ret = 1;
+   ret += queue_trytake_many (q, &mesgs[ret], &posted_ns[ret], nmesgs - ret);
+
+   uint64_t deadline = clock_ns () + (uint64_t)max_wait_us * 1000;
+   while (ret < nmesgs && max_wait_us) {
+      uint64_t now = clock_ns ();
+      if (now >= deadline)
+         break;
+
+      if (!(queue_wait (q, &mesgs[ret].mesg, &mesgs[ret].mesg_len,
+                        (deadline - now) / 1000, &posted_ns[ret], flags)))
+         break;
+
+      ret++;
+      ret += queue_trytake_many (q, &mesgs[ret], &posted_ns[ret], nmesgs - ret);
+   }
+
+   return ret;
+}
+
+static size_t queue_count (struct amq_queue_t *q)
+{
+   int actual = 0;
+
+   switch (q->engine) {
+      case amq_queue_engine_CMQ:
+         actual = cmq_count (q->cmq);
+         break;
+
+      case amq_queue_engine_RING:
+      case amq_queue_engine_INLINE:
+         actual = amq_ring_count (q->ring);
+         break;
+
+      case amq_queue_engine_SPSC:
+         actual = amq_spsc_count (q->spsc);
+         break;
+
+      case amq_queue_engine_INTRUSIVE:
+         return amq_ilist_count (q->ilist);
+
+      case amq_queue_engine_STEAL: {
+         uint32_t ndeques = __atomic_load_n (&q->ndeques, __ATOMIC_ACQUIRE);
+         int shared = cmq_count (q->cmq);
+         size_t total = shared > 0 ? shared : 0;
+         for (uint32_t i=0; i<ndeques; i++) {
+            amq_deque_t *deque = __atomic_load_n (&q->deques[i], __ATOMIC_ACQUIRE);
+            if (deque)
+               total += amq_deque_count (deque);
+         }
+         return total;
+      }
+   }
+
+   if (actual < 0)
+      return 0;
+
+   return actual;
+}
+
+/* ************************************************************
+ * Topics, which deliver every published message to each of the queues that
+ * are subscribed to them. The message itself is not copied: it is a shared
+ * payload from amq_shared_alloc(), with a reference count in a header in
+ * front of it, and each subscriber is given a reference.
+ *
+ * The subscribers are kept in an immutable list that is replaced whenever a
+ * queue subscribes or unsubscribes. Publishing may block on a full queue, so
+ * a publisher does not use the list inside an epoch read section; it takes
+ * a reference to the list in one, and the topic's own reference to a list
+ * that has been replaced is only dropped once no publisher can still be
+ * about to take one.
+ */
+struct topic_subs_t {
+   uint32_t             refcount;
+   size_t               nqueues;
+   struct amq_queue_t  *queues[];
+};
+
+struct topic_t {
+   char                *name;
+   struct topic_subs_t *subs;
+
+   // Serialises changes to the subscribers.
+   pthread_mutex_t      lock;
+
+   // Shared payloads from amq_shared_alloc().
+   amq_slab_t          *slab;
+};
+
+// Keeps the payload as well aligned as the slab's own buffers.
+struct shared_hdr_t {
+   uint32_t             refcount;
+   uint32_t             unused[3];
+};
+
+static struct topic_subs_t *subs_new (size_t nqueues)
+{
+   struct topic_subs_t *ret = calloc (1, sizeof *ret + nqueues * sizeof ret->queues[0]);
+   if (ret)
+      ret->refcount = 1;
+   return ret;
+}
+
+static void subs_unref (void *subs)
+{
+   struct topic_subs_t *s = subs;
+   if (!s || __atomic_sub_fetch (&s->refcount, 1, __ATOMIC_ACQ_REL))
+      return;
+
+   for (size_t i=0; i<s->nqueues; i++) {
+      queue_unref (s->queues[i]);
+   }
+   free (s);
+}
+
+static void topic_del (struct topic_t *t)
+{
+   if (!t)
+      return;
+
+   free (t->name);
+   subs_unref (t->subs);
+   amq_slab_del (t->slab);
+   pthread_mutex_destroy (&t->lock);
+   free (t);
+}
+
+static struct topic_t *topic_new (const char *name)
+{
+   struct topic_t *ret = calloc (1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   pthread_mutex_init (&ret->lock, NULL);
+   ret->name = ds_str_dup (name);
+   ret->subs = subs_new (0);
+   ret->slab = amq_slab_new ();
+
+   if (!ret->name || !ret->subs || !ret->slab) {
+      topic_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+// Returns a reference to the current subscribers, to be dropped with
+// subs_unref().
+static struct topic_subs_t *topic_subs (struct topic_t *t)
+{
+   amq_epoch_enter ();
+   struct topic_subs_t *ret = __atomic_load_n (&t->subs, __ATOMIC_ACQUIRE);
+   __atomic_add_fetch (&ret->refcount, 1, __ATOMIC_RELAXED);
+   amq_epoch_exit ();
+
+   return ret;
+}
+
+// Replace the subscribers with a copy that has queue added to it, or removed
+// from it. Returns false if the queue was already subscribed, or was not.
+static bool topic_change (struct topic_t *t, struct amq_queue_t *queue, bool add)
+{
+   bool ret = false;
+
+   pthread_mutex_lock (&t->lock);
+
+   struct topic_subs_t *old = t->subs;
+   size_t found = old->nqueues;
+   for (size_t i=0; i<old->nqueues; i++) {
+      if (old->queues[i] == queue)
+         found = i;
+   }
+   if (add == (found < old->nqueues))
+      goto errorexit;
+
+   struct topic_subs_t *subs = subs_new (add ? old->nqueues + 1 : old->nqueues - 1);
+   if (!subs) {
+      AMQ_ERROR_POST (-1, "Out of memory error: Failed to change subscribers of [%s]\n",
+                          t->name);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<old->nqueues; i++) {
+      if (i != found)
+         subs->queues[subs->nqueues++] = queue_ref (old->queues[i]);
+   }
+   if (add)
+      subs->queues[subs->nqueues++] = queue_ref (queue);
+
+   __atomic_store_n (&t->subs, subs, __ATOMIC_RELEASE);
+   amq_epoch_retire (old, subs_unref);
+   ret = true;
+
+errorexit:
+   pthread_mutex_unlock (&t->lock);
+   return ret;
+}
+
+static void shared_release (struct shared_hdr_t *hdr, uint32_t count)
+{
+   if (!(__atomic_sub_fetch (&hdr->refcount, count, __ATOMIC_ACQ_REL)))
+      amq_slab_free (hdr);
+}
+
+// Post buf to every subscriber, and drop the caller's reference. Every
+// subscriber is given its reference before anything is posted, so that the
+// first subscribers to finish with the payload cannot free it while it is
+// still being posted to the rest. Returns the number of queues it was posted
+// to.
+static size_t topic_publish (struct topic_t *t, void *buf, size_t buf_len)
+{
+   struct shared_hdr_t *hdr = (struct shared_hdr_t *)buf - 1;
+   struct topic_subs_t *subs = topic_subs (t);
+   size_t ret = 0;
+   size_t nowned = 0;
+
+   __atomic_add_fetch (&hdr->refcount, subs->nqueues, __ATOMIC_RELAXED);
+
+   for (size_t i=0; i<subs->nqueues; i++) {
+      switch (queue_post (subs->queues[i], buf, buf_len)) {
+         case amq_post_result_OK:
+            ret++;
+            break;
+
+         // The queue's discard function now has the reference.
+         case amq_post_result_DROPPED:
+            break;
+
+         default:
+            nowned++;
+            break;
+      }
+   }
+
+   shared_release (hdr, nowned + 1);
+   subs_unref (subs);
+
+   return ret;
+}
+
+/* ************************************************************
+ * Statistics object, to track performance of queues
+ */
+// Latencies are counted in a log-linear histogram: values below STATS_SUB_COUNT
+// nanoseconds get a bucket each, and every power of two above that is split
+// into STATS_SUB_COUNT equal buckets, so a bucket is never wider than 1/16th of
+// its lower bound. Values of 2^STATS_MAX_BITS ns (about 18 minutes) and more
+// all land in the last bucket.
+#define STATS_SUB_BITS        (4)
+#define STATS_SUB_COUNT       (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS        (40)
+#define STATS_NBUCKETS        ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_COUNT)
+
+// Only the owning worker updates its statistics, while any thread may read
+// them. The histogram buckets are independent counters; the summary fields are
+// guarded by a sequence lock so that readers never see a half-updated mean.
+struct stats_t {
+   uint32_t    seq;
+   uint64_t    count;
+   uint64_t    min_ns;
+   uint64_t    max_ns;
+   double      mean;
+   double      m2;
+   uint64_t    buckets[STATS_NBUCKETS];
+};
+
+static size_t stats_bucket (uint64_t ns)
+{
+   if (ns >= (1ULL << STATS_MAX_BITS))
+      return STATS_NBUCKETS - 1;
+
+   if (ns < STATS_SUB_COUNT)
+      return ns;
+
+   unsigned msb = 63 - __builtin_clzll (ns);
+   size_t sub = (ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_COUNT - 1);
+   return (msb - STATS_SUB_BITS + 1) * STATS_SUB_COUNT + sub;
+}
+
+// The largest value that is counted in the bucket.
+static uint64_t stats_bucket_max (size_t index)
+{
+   if (index < STATS_SUB_COUNT)
+      return index;
+
+   unsigned msb = index / STATS_SUB_COUNT + STATS_SUB_BITS - 1;
+   uint64_t sub = index % STATS_SUB_COUNT;
+   uint64_t width = 1ULL << (msb - STATS_SUB_BITS);
+   return ((STATS_SUB_COUNT + sub) * width) + width - 1;
+}
+
+static void stats_init (struct stats_t *so)
+{
+   memset (so, 0, sizeof *so);
+   so->min_ns = UINT64_MAX;
+}
+
+// Welford's algorithm keeps the mean and the sum of squared differences from
+// the mean exact without storing the samples.
+static void stats_update (struct stats_t *so, uint64_t ns)
+{
+   size_t index = stats_bucket (ns);
+   __atomic_store_n (&so->buckets[index], so->buckets[index] + 1, __ATOMIC_RELAXED);
+
+   uint32_t seq = so->seq;
+   __atomic_store_n (&so->seq, seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence (__ATOMIC_RELEASE);
+
+   uint64_t count = so->count + 1;
+   double delta = (double)ns - so->mean;
+   double mean = so->mean + delta / count;
+   double m2 = so->m2 + delta * ((double)ns - mean);
+
+   __atomic_store_n (&so->count, count, __ATOMIC_RELAXED);
+   if (ns < so->min_ns)
+      __atomic_store_n (&so->min_ns, ns, __ATOMIC_RELAXED);
+   if (ns > so->max_ns)
+      __atomic_store_n (&so->max_ns, ns, __ATOMIC_RELAXED);
+   __atomic_store (&so->mean, &mean, __ATOMIC_RELAXED);
+   __atomic_store (&so->m2, &m2, __ATOMIC_RELAXED);
+
+   __atomic_store_n (&so->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void stats_snapshot (struct stats_t *so, struct amq_stats_t *dst)
+{
+   uint32_t seq;
+   double mean, m2;
+
+   memset (dst, 0, sizeof *dst);
+
+   do {
+      while ((seq = __atomic_load_n (&so->seq, __ATOMIC_ACQUIRE)) & 1)
+         ;
+      dst->count = __atomic_load_n (&so->count, __ATOMIC_RELAXED);
+      dst->min_ns = __atomic_load_n (&so->min_ns, __ATOMIC_RELAXED);
+      dst->max_ns = __atomic_load_n (&so->max_ns, __ATOMIC_RELAXED);
+      __atomic_load (&so->mean, &mean, __ATOMIC_RELAXED);
+      __atomic_load (&so->m2, &m2, __ATOMIC_RELAXED);
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+   } while (__atomic_load_n (&so->seq, __ATOMIC_RELAXED) != seq);
+
+   if (!dst->count) {
+      dst->min_ns = 0;
+      return;
+   }
+
+   dst->mean_ns = mean;
+   dst->stddev_ns = dst->count > 1 ? sqrt (m2 / (dst->count - 1)) : 0.0;
+
+   // The buckets are read separately from the summary, so the histogram may be
+   // a few messages ahead of the count.
+   static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+   uint64_t *results[] = { &dst->p50_ns, &dst->p90_ns, &dst->p99_ns, &dst->p999_ns };
+   uint64_t counts[STATS_NBUCKETS];
+   uint64_t total = 0;
+
+   for (size_t i=0; i<STATS_NBUCKETS; i++) {
+      counts[i] = __atomic_load_n (&so->buckets[i], __ATOMIC_RELAXED);
+      total += counts[i];
+   }
+
+   size_t index = 0;
+   uint64_t seen = 0;
+   for (size_t q=0; q<sizeof quantiles / sizeof quantiles[0]; q++) {
+      uint64_t rank = (uint64_t)ceil (quantiles[q] * total);
+      while (index < STATS_NBUCKETS - 1 && seen + counts[index] < rank) {
+         seen += counts[index++];
+      }
+      uint64_t value = stats_bucket_max (index);
+      if (value > dst->max_ns)
+         value = dst->max_ns;
+      if (value < dst->min_ns)
+         value = dst->min_ns;
+      *results[q] = value;
+   }
+}
+
+static uint64_t elapsed_ns (uint64_t posted_ns, uint64_t now_ns)
+{
+   return now_ns > posted_ns ? now_ns - posted_ns : 0;
+}
+
+/* ************************************************************
+ * Worker objects, so we can keep track of workers
+ */
+
+#define WORKER_ERROR          (0)
+#define WORKER_PRODUCER       (1)
+#define WORKER_CONSUMER       (2)
+#define WORKER_BATCH_CONSUMER (3)
+#define WORKER_TASK_CONSUMER  (4)
+#define WORKER_MULTI_CONSUMER (5)
+union worker_func_t {
+   amq_producer_func_t        *producer_func;
+   amq_consumer_func_t        *consumer_func;
+   amq_batch_consumer_func_t  *batch_consumer_func;
+   amq_multi_consumer_func_t  *multi_consumer_func;
+};
+
+// One of the queues of a multi-queue consumer.
+struct multi_source_t {
+   struct amq_queue_t        *queue;
+   size_t                     weight;
+   struct queue_listener_t    listener;
+};
+
+struct worker_t {
+   // The following fields cannot be added to, removed from or swapped in order
+   // as they are public to the caller.
+   pthread_t             worker_id;
+   char                 *worker_name;
+   void                 *worker_cdata;
+   uint8_t               worker_type;
+
+   // These fields are private.
+   struct amq_queue_t   *listen_queue;
+   union worker_func_t   worker_func;
+   // Signals are set and cleared atomically. flags_seq is bumped on every
+   // change so that threads can sleep on it until the flags change.
+   uint64_t              flags;
+   uint32_t              flags_seq;
+
+   // The thread that runs the worker holds one reference, and each thread in
+   // amq_worker_sigwait() another; the struct is retired when the last one is
+   // dropped. gone is set, and flags_seq bumped, once the worker has finished.
+   uint32_t              refs;
+   uint32_t              gone;
+
+   struct stats_t        stats;
+
+   // Only used by batch consumers.
+   struct amq_message_t *batch;
+   uint64_t             *batch_posted_ns;
+   size_t                batch_max;
+   size_t                batch_wait_us;
+
+   // Only used by task consumers. task_state is TASK_IDLE or TASK_SCHEDULED;
+   // a task that is scheduled is either on the run queue or running, and is
+   // only ever on the run queue once. task_next links the run queue and
+   // task_listener links the tasks listening on the same queue.
+   uint32_t              task_state;
+   struct worker_t      *task_next;
+   struct worker_t      *task_listener;
+
+   // Only used by consumers of a work-stealing queue.
+   amq_deque_t          *steal_deque;
+   int                   steal_index;
+
+   // Only used by multi-queue consumers, which take messages from the nmulti
+   // queues in multi instead of from listen_queue, and sleep on multi_seq.
+   // multi_next is the queue to try first, and multi_taken the number of
+   // messages taken from it in a row.
+   struct multi_source_t *multi;
+   size_t                 nmulti;
+   enum amq_multi_policy_t multi_policy;
+   size_t                 multi_next;
+   size_t                 multi_taken;
+   uint32_t               multi_seq;
+   uint32_t               multi_waiting;
+
+   // The attributes that the thread applies to itself once it is running.
+   struct amq_worker_attr_t attr;
+};
+
+// Take a reference to a worker found by name; fails if it is already being
+// retired. Call inside an epoch read section that covers the lookup.
+static bool worker_ref (struct worker_t *w)
+{
+   uint32_t refs = __atomic_load_n (&w->refs, __ATOMIC_ACQUIRE);
+   do {
+      if (!refs)
+         return false;
+   } while (!(__atomic_compare_exchange_n (&w->refs, &refs, refs + 1, true,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)));
+   return true;
+}
+
+// Other threads may still be looking at the struct after it has been found by
+// name, so it is retired rather than freed.
+static void worker_unref (struct worker_t *w)
+{
+   if (__atomic_sub_fetch (&w->refs, 1, __ATOMIC_ACQ_REL) == 0)
+      amq_epoch_retire (w, free);
+}
+
+static void worker_sigwake (struct worker_t *worker)
+{
+   __atomic_add_fetch (&worker->flags_seq, 1, __ATOMIC_RELEASE);
+   amq_futex_wake (&worker->flags_seq, AMQ_FUTEX_ALL);
+}
+
+// Frees a worker whose thread never started, or has finished. Unlike
+// worker_del() this does not look the worker up by name, so it cannot signal
+// another worker that has the same name. Threads waiting on the worker's
+// signals are woken, and the struct itself lasts until they have gone.
+static void worker_free (struct worker_t *w)
+{
+   if (!w)
+      return;
+
+   free (w->worker_name);
+   w->worker_name = NULL;
+   if (w->steal_deque)
+      queue_release_deque (w->listen_queue, w->steal_index);
+   queue_detach (w->listen_queue);
+   for (size_t i=0; i<w->nmulti; i++) {
+      queue_remove_listener (w->multi[i].queue, &w->multi[i].listener);
+      queue_detach (w->multi[i].queue);
+   }
+   free (w->multi);
+   free (w->batch);
+   free (w->batch_posted_ns);
+
+   __atomic_store_n (&w->gone, 1, __ATOMIC_RELEASE);
+   worker_sigwake (w);
+   worker_unref (w);
+}
+
+static void worker_del (struct worker_t *w)
+{
+   if (!w)
+      return;
+
+   amq_worker_sigset (w->worker_name, AMQ_SIGNAL_TERMINATE);
+   amq_worker_wait (w->worker_name);
+   worker_free (w);
+}
+
+static struct worker_t *worker_new (const char *name, struct amq_queue_t *listen_queue,
+                                    uint8_t type,
+                                    void *worker_func, void *cdata)
+{
+   struct worker_t *ret = calloc (1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   ret->worker_type = type;
+   ret->worker_cdata = cdata;
+   ret->attr.numa_node = -1;
+   ret->refs = 1;
+
+   ret->worker_name = ds_str_dup (name);
+   stats_init (&ret->stats);
+
+   if (listen_queue) {
+      if (!(queue_attach (listen_queue))) {
+         AMQ_ERROR_POST (-1, "Cannot attach [%s] to queue [%s]: a single-consumer queue "
+                             "already has a consumer\n", name, listen_queue->name);
+         worker_free (ret);
+         return NULL;
+      }
+      ret->listen_queue = listen_queue;
+
+      if (listen_queue->engine == amq_queue_engine_STEAL) {
+         if ((ret->steal_index = queue_claim_deque (listen_queue)) < 0) {
+            AMQ_ERROR_POST (-1, "Cannot attach [%s] to queue [%s]: a work-stealing "
+                                "queue allows at most %i consumers\n", name,
+                                listen_queue->name, STEAL_MAX_CONSUMERS);
+            worker_free (ret);
+            return NULL;
+         }
+         ret->steal_deque = listen_queue->deques[ret->steal_index];
+      }
+   }
+
+   if (type==WORKER_PRODUCER)
+      ret->worker_func.producer_func = worker_func;
+
+   if (type==WORKER_CONSUMER || type==WORKER_TASK_CONSUMER)
+      ret->worker_func.consumer_func = worker_func;
+
+   if (type==WORKER_BATCH_CONSUMER)
+      ret->worker_func.batch_consumer_func = worker_func;
+
+   if (type==WORKER_MULTI_CONSUMER)
+      ret->worker_func.multi_consumer_func = worker_func;
+
+   if (!ret->worker_name               ||
+       !ret->worker_func.consumer_func ||
+       !ret->worker_func.producer_func) {
+      worker_free (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+static void task_schedule (struct worker_t *task);
+static void multi_interrupt (struct worker_t *w);
+
+static void worker_sigset (struct worker_t *worker, uint64_t signals)
+{
+   __atomic_fetch_or (&worker->flags, signals, __ATOMIC_SEQ_CST);
+   worker_sigwake (worker);
+
+   // A consumer blocked on an empty queue would otherwise only see the signal
+   // when the next message arrives.
+   if (worker->worker_type == WORKER_TASK_CONSUMER) {
+      task_schedule (worker);
+   } else if ((signals & WORKER_INTERRUPT_SIGNALS) && worker->listen_queue) {
+      queue_interrupt (worker->listen_queue);
+   } else if ((signals & WORKER_INTERRUPT_SIGNALS) && worker->nmulti) {
+      multi_interrupt (worker);
+   }
+}
+
+static void worker_sigclr (struct worker_t *worker, uint64_t signals)
+{
+   __atomic_fetch_and (&worker->flags, ~signals, __ATOMIC_SEQ_CST);
+   worker_sigwake (worker);
+
+   // A task that was suspended with messages waiting is not on the run queue.
+   if (worker->worker_type == WORKER_TASK_CONSUMER)
+      task_schedule (worker);
+}
+
+static uint64_t worker_sigget (struct worker_t *worker)
+{
+   return __atomic_load_n (&worker->flags, __ATOMIC_ACQUIRE);
+}
+
+// Sleep until one of the signals in sigmask is set, or until timeout_us
+// microseconds have passed. Termination always ends the wait, so that a worker
+// waiting on its own signals does not hold up amq_lib_destroy(). Returns the
+// flags as they were when the wait ended, or 0 if the worker finished. The
+// caller holds a reference to the worker.
+static uint64_t worker_sigwait (struct worker_t *worker, uint64_t sigmask,
+                                size_t timeout_us)
+{
+   uint64_t deadline = timeout_us == AMQ_FUTEX_FOREVER
+                     ? UINT64_MAX
+                     : clock_ns () + (uint64_t)timeout_us * 1000;
+
+   sigmask |= AMQ_SIGNAL_TERMINATE;
+
+   for (;;) {
+      // Read the sequence before the flags, so that a change made after we
+      // look at the flags makes the futex wait return immediately.
+      uint32_t seq = __atomic_load_n (&worker->flags_seq, __ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&worker->gone, __ATOMIC_ACQUIRE))
+         return 0;
+
+      uint64_t flags = worker_sigget (worker);
+      if ((flags & sigmask))
+         return flags;
+
+      uint64_t now = clock_ns ();
+      if (now >= deadline)
+         return flags;
+
+      amq_futex_wait (&worker->flags_seq, seq,
+                      timeout_us == AMQ_FUTEX_FOREVER ? AMQ_FUTEX_FOREVER
+                                                      : (deadline - now) / 1000);
+   }
+}
+
+// Park a suspended worker until the suspend signal is cleared or the worker is
+// told to terminate.
+static void worker_suspend (struct worker_t *w)
+{
+   for (;;) {
+      uint32_t seq = __atomic_load_n (&w->flags_seq, __ATOMIC_ACQUIRE);
+      uint64_t flags = worker_sigget (w);
+      if (!(flags & AMQ_SIGNAL_SUSPEND) || (flags & AMQ_SIGNAL_TERMINATE))
+         return;
+
+      amq_futex_wait (&w->flags_seq, seq, AMQ_FUTEX_FOREVER);
+   }
+}
+
+// Make the worker's work-stealing deque, if it has one, the deque that posts
+// from this thread go to. Passing NULL unbinds the thread.
+static void worker_bind_deque (struct worker_t *w)
+{
+   tl_steal_queue = w && w->steal_deque ? w->listen_queue : NULL;
+   tl_steal_deque = w ? w->steal_deque : NULL;
+}
+
+/* ************************************************************
+ * Multi-queue consumers. A post to any of the queues wakes the consumer
+ * through the listener it has on that queue (see queue_notify()), so the
+ * consumer only has one futex to sleep on however many queues it has.
+ */
+
+static bool multi_has_messages (struct worker_t *w)
+{
+   for (size_t i=0; i<w->nmulti; i++) {
+      if (queue_has_messages (w->multi[i].queue))
+         return true;
+   }
+   return false;
+}
+
+// Removes a single message from one of the worker's queues without blocking,
+// and sets index to the queue that it came from. With the weighted policy the
+// worker keeps taking from the same queue until it has taken its weight in
+// messages or the queue is empty, and then moves on to the next; with the
+// priority policy the queues are always tried in order.
+static bool multi_trytake (struct worker_t *w, void **buf, size_t *buf_len,
+                           uint64_t *posted_ns, size_t *index)
+{
+   for (size_t tried=0; tried<w->nmulti; tried++) {
+      size_t i = w->multi_policy == amq_multi_policy_PRIORITY ? tried : w->multi_next;
+
+      if (queue_trytake (w->multi[i].queue, buf, buf_len, posted_ns)) {
+         *index = i;
+         if (w->multi_policy == amq_multi_policy_WEIGHTED &&
+             ++w->multi_taken >= w->multi[i].weight) {
+            w->multi_taken = 0;
+            w->multi_next = (i + 1) % w->nmulti;
+         }
+         return true;
+      }
+
+      if (w->multi_policy == amq_multi_policy_WEIGHTED) {
+         w->multi_taken = 0;
+         w->multi_next = (i + 1) % w->nmulti;
+      }
+   }
+
+   return false;
+}
+
+// The same as queue_sleep(), but on the worker's own futex.
+static void multi_sleep (struct worker_t *w)
+{
+   uint32_t current = __atomic_load_n (&w->multi_seq, __ATOMIC_ACQUIRE);
+   __atomic_add_fetch (&w->multi_waiting, 1, __ATOMIC_SEQ_CST);
+
+   if (!multi_has_messages (w) && !queue_interrupted (&w->flags)) {
+      size_t timeout_us = AMQ_FUTEX_FOREVER;
+      for (size_t i=0; i<w->nmulti; i++) {
+         timeout_us = queue_sleep_timeout (w->multi[i].queue, timeout_us);
+      }
+      amq_slab_flush ();
+      amq_futex_wait (&w->multi_seq, current, timeout_us);
+   }
+
+   __atomic_sub_fetch (&w->multi_waiting, 1, __ATOMIC_RELAXED);
+}
+
+// Waits for a message on any of the worker's queues. Returns false if the
+// worker was interrupted.
+static bool multi_wait (struct worker_t *w, void **buf, size_t *buf_len,
+                        uint64_t *posted_ns, size_t *index)
+{
+   while (!(multi_trytake (w, buf, buf_len, posted_ns, index))) {
+      if (queue_interrupted (&w->flags))
+         return false;
+      multi_sleep (w);
+   }
+
+   return true;
+}
+
+static void multi_interrupt (struct worker_t *w)
+{
+   __atomic_add_fetch (&w->multi_seq, 1, __ATOMIC_SEQ_CST);
+   amq_futex_wake (&w->multi_seq, AMQ_FUTEX_ALL);
+}
+
+static void *worker_run (void *worker)
+{
+   struct worker_t *w = worker;
+   enum amq_worker_result_t worker_result = amq_worker_result_CONTINUE;
+   uint64_t flags = 0;
+
+   amq_thread_setup (w->worker_name, &w->attr);
+   worker_bind_deque (w);
+
+   while ((worker_result != amq_worker_result_STOP)) {
+
+      if ((flags = __atomic_load_n (&w->flags, __ATOMIC_RELAXED))) {
+         if ((flags & AMQ_SIGNAL_TERMINATE))
+            break;
+         if ((flags & AMQ_SIGNAL_SUSPEND)) {
+            worker_suspend (w);
+            continue;
+         }
+      }
+
+      worker_result = amq_worker_result_STOP;
+
+      if (w->worker_type == WORKER_PRODUCER) {
+         worker_result = w->worker_func.producer_func ((struct amq_worker_t *)w,
+                                                        w->worker_cdata);
+      }
+      if (w->worker_type == WORKER_CONSUMER) {
+         void *mesg = NULL;
+         size_t mesg_len = 0;
+         uint64_t posted_ns = 0;
+         worker_result = amq_worker_result_CONTINUE;
+
+         if (!(queue_wait (w->listen_queue, &mesg, &mesg_len, AMQ_FUTEX_FOREVER,
+                           &posted_ns, &w->flags)))
+            continue;
+
+         stats_update (&w->stats, elapsed_ns (posted_ns, clock_ns ()));
+
+         worker_result = w->worker_func.consumer_func ((struct amq_worker_t *)w,
+                                                        mesg, mesg_len, w->worker_cdata);
+         queue_release (w->listen_queue, mesg);
+      }
+      if (w->worker_type == WORKER_BATCH_CONSUMER) {
+         worker_result = amq_worker_result_CONTINUE;
+
+         size_t nmesgs = queue_wait_many (w->listen_queue, w->batch, w->batch_posted_ns,
+                                          w->batch_max, AMQ_FUTEX_FOREVER,
+                                          w->batch_wait_us, &w->flags);
+         if (!nmesgs)
+            continue;
+
+         uint64_t now = clock_ns ();
+         for (size_t i=0; i<nmesgs; i++) {
+            stats_update (&w->stats, elapsed_ns (w->batch_posted_ns[i], now));
+         }
+
+         worker_result = w->worker_func.batch_consumer_func ((struct amq_worker_t *)w,
+                                                              w->batch, nmesgs,
+                                                              w->worker_cdata);
+         for (size_t i=0; i<nmesgs; i++) {
+            queue_release (w->listen_queue, w->batch[i].mesg);
+         }
+      }
+      if (w->worker_type == WORKER_MULTI_CONSUMER) {
+         void *mesg = NULL;
+         size_t mesg_len = 0;
+         uint64_t posted_ns = 0;
+         size_t index = 0;
+         worker_result = amq_worker_result_CONTINUE;
+
+         if (!(multi_wait (w, &mesg, &mesg_len, &posted_ns, &index)))
+            continue;
+
+         stats_update (&w->stats, elapsed_ns (posted_ns, clock_ns ()));
+
+         struct amq_queue_t *q = w->multi[index].queue;
+         worker_result = w->worker_func.multi_consumer_func ((struct amq_worker_t *)w,
+                                                              q->name, mesg, mesg_len,
+                                                              w->worker_cdata);
+         queue_release (q, mesg);
+      }
+   }
+
+   amq_slab_flush ();
+
+   if (!(amq_container_remove (g_worker_container, w->worker_name))) {
+      AMQ_ERROR_POST (-1, "Could not remove [%s] from container - double-free()?\n", w->worker_name);
+   }
+   worker_del (w);
+
+   return NULL;
+}
+
+
+/* ************************************************************
+ * The executor runs task consumers on a fixed pool of threads. A task is
+ * scheduled (put on the run queue) when a message is posted to its queue or
+ * when it is signalled, and an executor thread then runs it until its queue
+ * is empty or it has handled TASK_BUDGET messages, whichever comes first. A
+ * task that runs out of budget goes to the back of the run queue so that one
+ * busy queue cannot starve the others.
+ *
+ * A task callback that blocks holds up its executor thread, so tasks should
+ * not block for long; a blocking consumer is better off with its own thread.
+ */
+#define TASK_IDLE          (0)
+#define TASK_SCHEDULED     (1)
+#define TASK_BUDGET        (64)
+
+static struct {
+   pthread_mutex_t   lock;
+   pthread_cond_t    cond;
+   struct worker_t  *head;
+   struct worker_t  *tail;
+   pthread_t        *threads;
+   size_t            nthreads;
+   bool              stopping;
+
+   // Bumped whenever a task finishes, for amq_worker_wait().
+   uint32_t          done_seq;
+} g_executor = {
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+   .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void executor_push (struct worker_t *task)
+{
+   pthread_mutex_lock (&g_executor.lock);
+   task->task_next = NULL;
+   if (g_executor.tail) {
+      g_executor.tail->task_next = task;
+   } else {
+      g_executor.head = task;
+   }
+   g_executor.tail = task;
+   pthread_cond_signal (&g_executor.cond);
+   pthread_mutex_unlock (&g_executor.lock);
+}
+
+// Returns NULL when the executor is stopping and the run queue is empty.
+static struct worker_t *executor_pop (void)
+{
+   pthread_mutex_lock (&g_executor.lock);
+   while (!g_executor.head && !g_executor.stopping) {
+      pthread_cond_wait (&g_executor.cond, &g_executor.lock);
+   }
+   struct worker_t *ret = g_executor.head;
+   if (ret) {
+      g_executor.head = ret->task_next;
+      if (!g_executor.head)
+         g_executor.tail = NULL;
+      ret->task_next = NULL;
+   }
+   pthread_mutex_unlock (&g_executor.lock);
+   return ret;
+}
+
+// Put the task on the run queue, unless it is already there or running.
+static void task_schedule (struct worker_t *task)
+{
+   uint32_t expected = TASK_IDLE;
+   if (__atomic_compare_exchange_n (&task->task_state, &expected, TASK_SCHEDULED, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      executor_push (task);
+}
+
+static void queue_schedule_tasks (struct amq_queue_t *q, int32_t ntasks)
+{
+   pthread_mutex_lock (&q->tasks_lock);
+   for (struct worker_t *t=q->tasks; t && ntasks > 0; t=t->task_listener) {
+      if (__atomic_load_n (&t->task_state, __ATOMIC_RELAXED) == TASK_IDLE) {
+         task_schedule (t);
+         ntasks--;
+      }
+   }
+   pthread_mutex_unlock (&q->tasks_lock);
+}
+
+static void queue_add_task (struct amq_queue_t *q, struct worker_t *task)
+{
+   pthread_mutex_lock (&q->tasks_lock);
+   task->task_listener = q->tasks;
+   q->tasks = task;
+   __atomic_add_fetch (&q->ntasks, 1, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock (&q->tasks_lock);
+}
+
+static void queue_remove_task (struct amq_queue_t *q, struct worker_t *task)
+{
+   pthread_mutex_lock (&q->tasks_lock);
+   for (struct worker_t **t=&q->tasks; *t; t=&(*t)->task_listener) {
+      if (*t == task) {
+         *t = task->task_listener;
+         __atomic_sub_fetch (&q->ntasks, 1, __ATOMIC_RELAXED);
+         break;
+      }
+   }
+   pthread_mutex_unlock (&q->tasks_lock);
+}
+
+// Once the task is off its queue's list and out of the worker container,
+// nothing else can schedule it, so it can be deleted.
+static void task_finish (struct worker_t *task)
+{
+   queue_remove_task (task->listen_queue, task);
+   if (!(amq_container_remove (g_worker_container, task->worker_name))) {
+      AMQ_ERROR_POST (-1, "Could not remove [%s] from container - double-free()?\n",
+                          task->worker_name);
+   }
+   __atomic_add_fetch (&g_executor.done_seq, 1, __ATOMIC_RELEASE);
+   amq_futex_wake (&g_executor.done_seq, AMQ_FUTEX_ALL);
+   worker_del (task);
+}
+
+static void task_run (struct worker_t *task)
+{
+   struct amq_queue_t *q = task->listen_queue;
+   uint64_t flags = 0;
+   size_t i;
+
+   task->worker_id = pthread_self ();
+
+   for (i=0; i<TASK_BUDGET; i++) {
+      if ((flags = __atomic_load_n (&task->flags, __ATOMIC_RELAXED))) {
+         if ((flags & AMQ_SIGNAL_TERMINATE)) {
+            task_finish (task);
+            return;
+         }
+         if ((flags & AMQ_SIGNAL_SUSPEND))
+            break;
+      }
+
+      void *mesg = NULL;
+      size_t mesg_len = 0;
+      uint64_t posted_ns = 0;
+      if (!(queue_trytake (q, &mesg, &mesg_len, &posted_ns)))
+         break;
+
+      stats_update (&task->stats, elapsed_ns (posted_ns, clock_ns ()));
+
+      enum amq_worker_result_t result =
+         task->worker_func.consumer_func ((struct amq_worker_t *)task,
+                                          mesg, mesg_len, task->worker_cdata);
+      queue_release (q, mesg);
+      if (result == amq_worker_result_STOP) {
+         task_finish (task);
+         return;
+      }
+   }
+
+   if (i == TASK_BUDGET) {
+      executor_push (task);
+      return;
+   }
+
+   // Going idle pairs with the fence in queue_notify() and the atomic update
+   // in worker_sigset(): either we see the new message or signal here, or the
+   // other side sees that we are idle and schedules us.
+   __atomic_store_n (&task->task_state, TASK_IDLE, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+   flags = __atomic_load_n (&task->flags, __ATOMIC_RELAXED);
+   if ((flags & AMQ_SIGNAL_TERMINATE) ||
+       (!(flags & AMQ_SIGNAL_SUSPEND) && queue_has_messages (q)))
+      task_schedule (task);
+}
+
+static void *executor_run (void *index)
+{
+   struct worker_t *task;
+   char name[16];
+
+   snprintf (name, sizeof name, "amq-exec-%zu", (size_t)(uintptr_t)index);
+   amq_thread_setup (name, NULL);
+
+   while ((task = executor_pop ())) {
+      worker_bind_deque (task);
+      task_run (task);
+      worker_bind_deque (NULL);
+   }
+
+   amq_slab_flush ();
+
+   return NULL;
+}
+
+// Starting an executor that is already running does nothing.
+static bool executor_start (size_t nthreads)
+{
+   bool error = true;
+
+   pthread_mutex_lock (&g_executor.lock);
+
+   if (g_executor.threads) {
+      error = false;
+      goto errorexit;
+   }
+
+   if (!nthreads) {
+      long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+      nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+   }
+
+   if (!(g_executor.threads = calloc (nthreads, sizeof *g_executor.threads))) {
+      AMQ_ERROR_POST (-1, "Out of memory error: Failed to allocate %zu executor threads\n",
+                          nthreads);
+      goto errorexit;
+   }
+
+   g_executor.stopping = false;
+   for (g_executor.nthreads=0; g_executor.nthreads<nthreads; g_executor.nthreads++) {
+      if ((pthread_create (&g_executor.threads[g_executor.nthreads], NULL,
+                           executor_run, (void *)(uintptr_t)g_executor.nthreads))!=0) {
+         AMQ_ERROR_POST (-1, "Failed to create executor thread: %m\n");
+         break;
+      }
+   }
+
+   // Running on fewer threads than asked for is better than not running.
+   error = g_executor.nthreads == 0;
+
+errorexit:
+   if (error) {
+      free (g_executor.threads);
+      g_executor.threads = NULL;
+   }
+   pthread_mutex_unlock (&g_executor.lock);
+   return !error;
+}
+
+// All the tasks must have finished before the executor is stopped.
+static void executor_stop (void)
+{
+   pthread_mutex_lock (&g_executor.lock);
+   g_executor.stopping = true;
+   pthread_cond_broadcast (&g_executor.cond);
+   pthread_mutex_unlock (&g_executor.lock);
+
+   for (size_t i=0; i<g_executor.nthreads; i++) {
+      pthread_join (g_executor.threads[i], NULL);
+   }
+
+   pthread_mutex_lock (&g_executor.lock);
+   free (g_executor.threads);
+   g_executor.threads = NULL;
+   g_executor.nthreads = 0;
+   pthread_mutex_unlock (&g_executor.lock);
+}
+
+// Tasks have no thread to join, so waiting for one means waiting until its
+// name disappears from the worker container.
+static void executor_wait (const char *worker_name)
+{
+   for (;;) {
+      uint32_t seq = __atomic_load_n (&g_executor.done_seq, __ATOMIC_ACQUIRE);
+      if (!(amq_container_find (g_worker_container, worker_name)))
+         return;
+      amq_futex_wait (&g_executor.done_seq, seq, AMQ_FUTEX_FOREVER);
+   }
+}
+
+/* ************************************************************
+ * Internal utility functions.
+ */
+static char *gen_random_string (size_t nbytes)
+{
+   static int seed = 0;
+   if (!seed) {
+      seed = (int)time (NULL);
+      srand (seed);
+   }
+
+   char *ret = malloc ((nbytes * 2) + 1);
+   if (!ret)
+      return ds_str_dup ("");
+
+   for (size_t i=0; i<nbytes; i++) {
+      uint8_t r = rand () & 0xff;
+      snprintf (&ret[i*2], 3, "%02x", r);
+   }
+   return ret;
+}
+
+/* ************************************************************
+ * Public variables and functions
+ */
+
+bool amq_lib_init (void)
+{
+   bool error = true;
+
+   if (!(g_queue_container = amq_container_new ()) ||
+       !(g_worker_container = amq_container_new ()) ||
+       !(g_topic_container = amq_container_new ())) {
+      goto errorexit;
+   }
+
+   // Reporting an error must never block or allocate, so the error queue is a
+   // ring that is as large as the pool of errors, and drops errors when full.
+   if (!(amq_message_queue_create_ex (AMQ_QUEUE_ERROR, amq_queue_engine_RING,
+                                      AMQ_ERROR_POOL_SIZE)) ||
+       !(amq_queue_set_limit (AMQ_QUEUE_ERROR, 0, amq_post_policy_DROP_NEWEST,
+                              error_discard)))
+      goto errorexit;
+
+   error = false;
+
+errorexit:
+   if (error) {
+      amq_lib_destroy ();
+   }
+   return !error;
+}
+
+void amq_lib_destroy (void)
+{
+#if 1
+   char **worker_names = NULL;
+
+   if ((amq_container_names (g_worker_container, &worker_names))!=0 && worker_names) {
+      for (size_t i=0; worker_names[i]; i++) {
+         amq_worker_sigset (worker_names[i], AMQ_SIGNAL_TERMINATE);
+         amq_worker_wait (worker_names[i]);
+         free (worker_names[i]);
+      }
+      free (worker_names);
+   }
+#endif
+
+   executor_stop ();
+   amq_slab_flush ();
+
+   amq_container_del (g_worker_container, NULL);
+   g_worker_container = NULL;
+
+   amq_container_del (g_topic_container, (void (*) (void *))topic_del);
+   g_topic_container = NULL;
+
+   amq_container_del (g_queue_container, (void (*) (void *))queue_unref);
+   g_queue_container = NULL;
+
+}
+
+bool amq_message_queue_create (const char *name)
+{
+   return amq_message_queue_create_ex (name, amq_queue_engine_CMQ, 0);
+}
+
+static bool message_queue_add (const char *name, struct amq_queue_t *newq)
+{
+   if (!newq) {
+      return false;
+   }
+
+   if (!(amq_container_add (g_queue_container, name, newq))) {
+      queue_del (newq);
+      return false;
+   }
+
+   return true;
+}
+
+static bool message_queue_create (const char *name, enum amq_queue_engine_t engine,
+                                  size_t capacity, size_t msg_size)
+{
+   return message_queue_add (name, queue_new (name, engine, capacity, msg_size));
+}
+
+bool amq_message_queue_create_ex (const char *name,
+                                  enum amq_queue_engine_t engine, size_t capacity)
+{
+   return message_queue_create (name, engine, capacity, 0);
+}
+
+bool amq_message_queue_create_inline (const char *name, size_t capacity,
+                                      size_t max_msg_size)
+{
+   if (!max_msg_size) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s]: inline messages must have a size\n", name);
+      return false;
+   }
+
+   return message_queue_create (name, amq_queue_engine_INLINE, capacity, max_msg_size);
+}
+
+bool amq_message_queue_create_shm (const char *name, size_t capacity, size_t slot_size)
+{
+   // Checked first so that a clash does not leave a new object behind.
+   if (amq_container_find (g_queue_container, name)) {
+      AMQ_ERROR_POST (EEXIST, "Queue [%s]: already exists\n", name);
+      return false;
+   }
+
+   return message_queue_add (name, queue_new_shm (name, capacity, slot_size));
+}
+
+bool amq_message_queue_unlink_shm (const char *name)
+{
+   char path[NAME_MAX + 1];
+   if (!(shm_path (path, sizeof path, name))) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s]: not a valid shared-memory queue name\n", name);
+      return false;
+   }
+
+   if (shm_unlink (path) != 0) {
+      AMQ_ERROR_POST (errno, "Queue [%s]: failed to unlink [%s]: %m\n", name, path);
+      return false;
+   }
+
+   return true;
+}
+
+enum amq_post_result_t amq_post (const char *queue_name, void *buf, size_t buf_len)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue || queue_is_inline (queue))
+      return amq_post_result_ERROR;
+
+   return queue_post (queue, buf, buf_len);
+}
+
+enum amq_post_result_t amq_post_try (const char *queue_name, void *buf, size_t buf_len)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue || queue_is_inline (queue))
+      return amq_post_result_ERROR;
+
+   return queue_post_timed (queue, buf, buf_len, 0);
+}
+
+enum amq_post_result_t amq_post_timed (const char *queue_name, void *buf, size_t buf_len,
+                                       size_t timeout_us)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue || queue_is_inline (queue))
+      return amq_post_result_ERROR;
+
+   return queue_post_timed (queue, buf, buf_len, timeout_us);
+}
+
+size_t amq_post_many (const char *queue_name, void **bufs, size_t *buf_lens, size_t nbufs)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue || queue_is_inline (queue))
+      return 0;
+
+   return queue_post_many (queue, bufs, buf_lens, nbufs);
+}
+
+bool amq_queue_set_limit (const char *queue_name, size_t high_water,
+                          enum amq_post_policy_t policy,
+                          amq_discard_func_t *discard_func)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue)
+      return false;
+
+   // Dropping the oldest message means the producer pops from the queue, which
+   // would make it a second consumer of an spsc queue.
+   if (queue->engine == amq_queue_engine_SPSC && policy == amq_post_policy_DROP_OLDEST) {
+      AMQ_ERROR_POST (-1, "Queue [%s]: spsc queues cannot drop the oldest message\n",
+                      queue_name);
+      return false;
+   }
+
+   __atomic_store_n (&queue->discard_func, discard_func, __ATOMIC_RELEASE);
+   __atomic_store_n (&queue->policy, policy, __ATOMIC_RELEASE);
+   __atomic_store_n (&queue->high_water, high_water, __ATOMIC_RELEASE);
+
+   // Producers blocked on the old limit must re-check against the new one.
+   __atomic_add_fetch (&queue->sync->space_seq, 1, __ATOMIC_RELEASE);
+   queue_futex_wake (queue, &queue->sync->space_seq, AMQ_FUTEX_ALL);
+
+   return true;
+}
+
+bool amq_queue_set_spill (const char *queue_name, const char *dir,
+                          size_t high_water, size_t low_water,
+                          amq_alloc_func_t *alloc_func,
+                          amq_discard_func_t *release_func)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue)
+      return false;
+
+   if (queue->engine != amq_queue_engine_CMQ && queue->engine != amq_queue_engine_RING) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s]: only cmq and ring queues can spill to disk\n",
+                      queue_name);
+      return false;
+   }
+
+   if (!dir || !high_water || low_water >= high_water ||
+       high_water > queue_capacity (queue)) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s]: invalid spill directory or marks [%zu:%zu]\n",
+                      queue_name, high_water, low_water);
+      return false;
+   }
+
+   if (!alloc_func || !release_func) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s]: spilling needs an alloc and a release function\n",
+                      queue_name);
+      return false;
+   }
 
-   if (type==WORKER_CONSUMER)
-      ret->worker_func.consumer_func = worker_func;
+   if (queue->spill) {
+      AMQ_ERROR_POST (EEXIST, "Queue [%s]: already spills to disk\n", queue_name);
+      return false;
+   }
 
-   if (!ret->worker_name               ||
-       !ret->worker_func.consumer_func ||
-       !ret->worker_func.producer_func) {
-      worker_del (ret);
-      ret = NULL;
+   // Processes spilling the same queue to the same directory use their own files,
+   // and the whole name is used so that queues spilling there do not share files.
+   char *prefix = NULL;
+   if (!(ds_str_printf (&prefix, "amq.%ld.%s", (long)getpid (), queue_name))) {
+      free (prefix);
+      return false;
    }
 
-   ret->stats.min = 999999.9999;
-   return ret;
+   amq_spill_t *spill = amq_spill_new (dir, prefix, 0);
+   free (prefix);
+   if (!spill)
+      return false;
+
+   queue->spill_high = high_water;
+   queue->spill_low = low_water;
+   queue->spill_alloc = alloc_func;
+   queue->spill_release = release_func;
+   __atomic_store_n (&queue->spill, spill, __ATOMIC_RELEASE);
+
+   return true;
 }
 
-static void worker_sigset (struct worker_t *worker, uint64_t signals)
+enum amq_post_result_t amq_post_copy (const char *queue_name, const void *buf,
+                                      size_t buf_len)
 {
-   // TODO: Could be faster using pthread_rwlock_t instead of a mutex.
-   pthread_mutex_lock (&worker->flags_lock);
-   worker->flags |= signals;
-   pthread_mutex_unlock (&worker->flags_lock);
+   return amq_post_copy_h (amq_container_find (g_queue_container, queue_name), buf, buf_len);
 }
 
-static void worker_sigclr (struct worker_t *worker, uint64_t signals)
+void *amq_msg_alloc (const char *queue_name, size_t size)
 {
-   // TODO: Could be faster using pthread_rwlock_t instead of a mutex.
-   pthread_mutex_lock (&worker->flags_lock);
-   worker->flags &= ~signals;
-   pthread_mutex_unlock (&worker->flags_lock);
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue)
+      return NULL;
+
+   return amq_slab_alloc (queue->slab, size);
 }
 
-static uint64_t worker_sigget (struct worker_t *worker)
+void amq_msg_release (void *buf)
 {
-   // TODO: Could be faster using pthread_rwlock_t instead of a mutex.
-   pthread_mutex_lock (&worker->flags_lock);
-   uint64_t ret = worker->flags;
-   pthread_mutex_unlock (&worker->flags_lock);
-   return ret;
+   amq_slab_free (buf);
 }
 
-static void *worker_run (void *worker)
+void amq_msg_flush (void)
 {
-   struct worker_t *w = worker;
-   enum amq_worker_result_t worker_result = amq_worker_result_CONTINUE;
-   uint64_t flags = 0;
+   amq_slab_flush ();
+}
 
-   while ((worker_result != amq_worker_result_STOP)) {
+size_t amq_count (const char *queue_name)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue)
+      return 0;
 
-      if ((pthread_mutex_trylock (&w->flags_lock))==0) {
-         flags = w->flags;
-         pthread_mutex_unlock (&w->flags_lock);
-         if ((flags & AMQ_SIGNAL_TERMINATE))
-            break;
-         if ((flags & AMQ_SIGNAL_SUSPEND)) {
-            sleep (1);
-            continue;
-         }
-      }
+   return queue_count (queue) + __atomic_load_n (&queue->spilled, __ATOMIC_RELAXED);
+}
 
-      worker_result = amq_worker_result_STOP;
+bool amq_topic_create (const char *name)
+{
+   struct topic_t *topic = topic_new (name);
+   if (!topic)
+      return false;
 
-      if (w->worker_type == WORKER_PRODUCER) {
-         worker_result = w->worker_func.producer_func ((struct amq_worker_t *)w,
-                                                        w->worker_cdata);
-      }
-      if (w->worker_type == WORKER_CONSUMER) {
-         void *mesg = NULL;
-         size_t mesg_len = 0;
-         worker_result = amq_worker_result_CONTINUE;
+   if (!(amq_container_add (g_topic_container, name, topic))) {
+      topic_del (topic);
+      return false;
+   }
 
-         struct timespec ts;
-         if (!(cmq_wait (w->listen_queue, &mesg, &mesg_len, 1000, &ts)))
-            continue;
+   return true;
+}
 
-         amq_stats_update (&w->stats, timespec_conv (&ts));
+bool amq_topic_subscribe (const char *topic_name, const char *queue_name)
+{
+   struct topic_t *topic = amq_container_find (g_topic_container, topic_name);
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!topic || !queue)
+      return false;
 
-         worker_result = w->worker_func.consumer_func ((struct amq_worker_t *)w,
-                                                        mesg, mesg_len, w->worker_cdata);
-      }
+   // The same message is in every subscribed queue at once, so it cannot be
+   // linked through its header or copied into the queue.
+   if (queue->engine == amq_queue_engine_INTRUSIVE || queue_is_inline (queue)) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s] cannot subscribe to topic [%s]: intrusive and "
+                              "inline queues cannot share messages\n", queue_name, topic_name);
+      return false;
    }
 
-   if (!(amq_container_remove (g_worker_container, w->worker_name))) {
-      AMQ_ERROR_POST (-1, "Could not remove [%s] from container - double-free()?\n", w->worker_name);
+   // Any thread may publish, which would make the topic a second producer.
+   if (queue->engine == amq_queue_engine_SPSC) {
+      AMQ_ERROR_POST (EINVAL, "Queue [%s] cannot subscribe to topic [%s]: spsc queues "
+                              "have a single producer\n", queue_name, topic_name);
+      return false;
    }
-   worker_del (w);
 
-   return NULL;
+   return topic_change (topic, queue, true);
 }
 
+bool amq_topic_unsubscribe (const char *topic_name, const char *queue_name)
+{
+   struct topic_t *topic = amq_container_find (g_topic_container, topic_name);
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!topic || !queue)
+      return false;
 
-/* ************************************************************
- * Internal utility functions.
- */
-static char *gen_random_string (size_t nbytes)
+   return topic_change (topic, queue, false);
+}
+
+void *amq_shared_alloc (const char *topic_name, size_t size)
 {
-   static int seed = 0;
-   if (!seed) {
-      seed = (int)time (NULL);
-      srand (seed);
-   }
+   struct topic_t *topic = amq_container_find (g_topic_container, topic_name);
+   if (!topic)
+      return NULL;
 
-   char *ret = malloc ((nbytes * 2) + 1);
-   if (!ret)
-      return ds_str_dup ("");
+   struct shared_hdr_t *hdr = amq_slab_alloc (topic->slab, sizeof *hdr + size);
+   if (!hdr)
+      return NULL;
 
-   for (size_t i=0; i<nbytes; i++) {
-      uint8_t r = rand () & 0xff;
-      snprintf (&ret[i*2], 3, "%02x", r);
-   }
-   return ret;
+   hdr->refcount = 1;
+   return hdr + 1;
 }
 
-/* ************************************************************
- * Public variables and functions
- */
+void amq_shared_release (void *buf)
+{
+   if (buf)
+      shared_release ((struct shared_hdr_t *)buf - 1, 1);
+}
 
-bool amq_lib_init (void)
+size_t amq_publish (const char *topic_name, void *buf, size_t buf_len)
 {
-   bool error = true;
+   if (!buf)
+      return 0;
 
-   if (!(g_queue_container = amq_container_new ()) ||
-       !(g_worker_container = amq_container_new ())) {
-      goto errorexit;
+   struct topic_t *topic = amq_container_find (g_topic_container, topic_name);
+   if (!topic) {
+      amq_shared_release (buf);
+      return 0;
    }
 
-   if (!(amq_message_queue_create (AMQ_QUEUE_ERROR)))
-      goto errorexit;
+   return topic_publish (topic, buf, buf_len);
+}
 
-   error = false;
+bool amq_try_take (const char *queue_name, void **buf, size_t *buf_len)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue || !buf)
+      return false;
 
-errorexit:
-   if (error) {
-      amq_lib_destroy ();
-   }
-   return !error;
+   return queue_try_take (queue, buf, buf_len);
 }
 
-void amq_lib_destroy (void)
+int amq_queue_fd (const char *queue_name)
 {
-#if 1
-   char **worker_names = NULL;
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue)
+      return -1;
 
-   if ((amq_container_names (g_worker_container, &worker_names))!=0 && worker_names) {
-      for (size_t i=0; worker_names[i]; i++) {
-         amq_worker_sigset (worker_names[i], AMQ_SIGNAL_TERMINATE);
-         amq_worker_wait (worker_names[i]);
-         free (worker_names[i]);
-      }
-      free (worker_names);
+   return queue_event_fd (queue);
+}
+
+amq_queue_t *amq_queue_open (const char *queue_name)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_name);
+   if (!queue) {
+      AMQ_ERROR_POST (-1, "Cannot open [%s]: no such queue\n", queue_name);
+      return NULL;
    }
-#endif
 
-   amq_container_del (g_worker_container, NULL);
-   g_worker_container = NULL;
+   return queue_ref (queue);
+}
 
-   amq_container_del (g_queue_container, (void (*) (void *))queue_del);
-   g_queue_container = NULL;
+void amq_queue_close (amq_queue_t *queue)
+{
+   queue_unref (queue);
+}
 
+const char *amq_queue_name (amq_queue_t *queue)
+{
+   return queue ? queue->name : "";
 }
 
-bool amq_message_queue_create (const char *name)
+enum amq_post_result_t amq_post_h (amq_queue_t *queue, void *buf, size_t buf_len)
 {
-   struct queue_t *newq = queue_new (name);
-   if (!newq) {
-      return false;
-   }
+   if (!queue || queue_is_inline (queue))
+      return amq_post_result_ERROR;
 
-   if (!(amq_container_add (g_queue_container, name, newq))) {
-      queue_del (newq);
-      return false;
-   }
+   return queue_post (queue, buf, buf_len);
+}
 
-   return true;
+enum amq_post_result_t amq_post_try_h (amq_queue_t *queue, void *buf, size_t buf_len)
+{
+   if (!queue || queue_is_inline (queue))
+      return amq_post_result_ERROR;
+
+   return queue_post_timed (queue, buf, buf_len, 0);
+}
+
+enum amq_post_result_t amq_post_timed_h (amq_queue_t *queue, void *buf, size_t buf_len,
+                                         size_t timeout_us)
+{
+   if (!queue || queue_is_inline (queue))
+      return amq_post_result_ERROR;
+
+   return queue_post_timed (queue, buf, buf_len, timeout_us);
+}
+
+size_t amq_post_many_h (amq_queue_t *queue, void **bufs, size_t *buf_lens, size_t nbufs)
+{
+   if (!queue || queue_is_inline (queue))
+      return 0;
+
+   return queue_post_many (queue, bufs, buf_lens, nbufs);
+}
+
+enum amq_post_result_t amq_post_copy_h (amq_queue_t *queue, const void *buf, size_t buf_len)
+{
+   if (!queue || !(queue_is_inline (queue)) || buf_len > amq_ring_msg_size (queue->ring))
+      return amq_post_result_ERROR;
+
+   return queue_post (queue, (void *)buf, buf_len);
 }
 
-void amq_post (const char *queue_name, void *buf, size_t buf_len)
+void *amq_msg_alloc_h (amq_queue_t *queue, size_t size)
 {
-   struct queue_t *queue = amq_container_find (g_queue_container, queue_name);
    if (!queue)
-      return;
+      return NULL;
 
-   cmq_post (queue->cmq, buf, buf_len);
+   return amq_slab_alloc (queue->slab, size);
 }
 
-size_t amq_count (const char *queue_name)
+size_t amq_count_h (amq_queue_t *queue)
 {
-   struct queue_t *queue = amq_container_find (g_queue_container, queue_name);
    if (!queue)
       return 0;
 
-   int actual = cmq_count (queue->cmq);
-   if (actual < 0)
-      return 0;
+   return queue_count (queue) + __atomic_load_n (&queue->spilled, __ATOMIC_RELAXED);
+}
 
-   return actual;
+bool amq_try_take_h (amq_queue_t *queue, void **buf, size_t *buf_len)
+{
+   if (!queue || !buf)
+      return false;
+
+   return queue_try_take (queue, buf, buf_len);
 }
 
-static bool worker_create (const char *worker_name, cmq_t *listen_queue, uint8_t type,
-                           void *worker_func, void *cdata)
+int amq_queue_fd_h (amq_queue_t *queue)
+{
+   if (!queue)
+      return -1;
+
+   return queue_event_fd (queue);
+}
+
+// Workers are created in two steps so that the caller can finish setting up the
+// worker before its thread starts: worker_create() returns a worker that has
+// not been started, worker_start() adds it to the container and starts it.
+static struct worker_t *worker_create (const char *worker_name,
+                                       struct amq_queue_t *listen_queue, uint8_t type,
+                                       void *worker_func, void *cdata)
 {
-   bool error = true;
    char *actual_name = NULL;
 
    if (!worker_name || !worker_name[0]) {
@@ -432,18 +3115,51 @@ static bool worker_create (const char *worker_name, cmq_t *listen_queue, uint8_t
 
    struct worker_t *worker = worker_new (actual_name, listen_queue, type,
                                          worker_func, cdata);
+   free (actual_name);
+
+   return worker;
+}
+
+static bool worker_start (struct worker_t *worker, const struct amq_worker_attr_t *attr)
+{
+   bool error = true;
+   bool added = false;
+   pthread_attr_t pattr;
+   bool pattr_valid = false;
 
    if (!worker)
+      return false;
+
+   if (!(amq_container_add (g_worker_container, worker->worker_name, worker))) {
+      AMQ_ERROR_POST (-1, "Failed to create worker [%s]: name already in use\n",
+                          worker->worker_name);
+      goto errorexit;
+   }
+   added = true;
+
+   if (worker->worker_type == WORKER_TASK_CONSUMER) {
+      if (!(executor_start (0)))
+         goto errorexit;
+      queue_add_task (worker->listen_queue, worker);
+      task_schedule (worker);
+      error = false;
       goto errorexit;
+   }
 
-   if (!(amq_container_add (g_worker_container, actual_name, worker))) {
-      // TODO: Post an error to the AMQ_QUEUE_ERROR queue
-      AMQ_ERROR_POST (-1, "Failed to create thread: %m\n");
+   pattr_valid = true;
+   if (!(amq_thread_attr_init (&pattr, attr)))
       goto errorexit;
+
+   if (attr) {
+      worker->attr = *attr;
+      worker->attr.cpus = NULL;
+      worker->attr.ncpus = 0;
    }
 
-   if ((pthread_create (&worker->worker_id, NULL, worker_run, worker))!=0) {
-      // TODO: Post an error to the AMQ_QUEUE_ERROR queue
+   int rc;
+   if ((rc = pthread_create (&worker->worker_id, &pattr, worker_run, worker))!=0) {
+      // A real-time priority without the privilege to use it fails here.
+      errno = rc;
       AMQ_ERROR_POST (-1, "Failed to create thread: %m\n");
       goto errorexit;
    }
@@ -451,11 +3167,14 @@ static bool worker_create (const char *worker_name, cmq_t *listen_queue, uint8_t
    error = false;
 
 errorexit:
+   if (pattr_valid)
+      pthread_attr_destroy (&pattr);
+
    if (error) {
-      amq_container_remove (g_worker_container, actual_name);
-      worker_del (worker);
+      if (added)
+         amq_container_remove (g_worker_container, worker->worker_name);
+      worker_free (worker);
    }
-   free (actual_name);
 
    return !error;
 }
@@ -463,19 +3182,143 @@ errorexit:
 bool amq_producer_create (const char *worker_name,
                           amq_producer_func_t *worker_func, void *cdata)
 {
-   return worker_create (worker_name, NULL, WORKER_PRODUCER, worker_func, cdata);
+   return amq_producer_create_ex (worker_name, worker_func, cdata, NULL);
+}
+
+bool amq_producer_create_ex (const char *worker_name,
+                             amq_producer_func_t *worker_func, void *cdata,
+                             const struct amq_worker_attr_t *attr)
+{
+   return worker_start (worker_create (worker_name, NULL, WORKER_PRODUCER,
+                                       worker_func, cdata), attr);
 }
 
 bool amq_consumer_create (const char *supply_queue_name,
                           const char *worker_name,
                           amq_consumer_func_t *worker_func, void *cdata)
 {
-   struct queue_t *queue = amq_container_find (g_queue_container, supply_queue_name);
+   return amq_consumer_create_ex (supply_queue_name, worker_name, worker_func, cdata,
+                                  NULL);
+}
+
+bool amq_consumer_create_ex (const char *supply_queue_name,
+                             const char *worker_name,
+                             amq_consumer_func_t *worker_func, void *cdata,
+                             const struct amq_worker_attr_t *attr)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, supply_queue_name);
+   if (!queue)
+      return false;
+
+   return worker_start (worker_create (worker_name, queue, WORKER_CONSUMER,
+                                       worker_func, cdata), attr);
+}
+
+bool amq_executor_start (size_t nthreads)
+{
+   return executor_start (nthreads);
+}
+
+bool amq_task_consumer_create (const char *supply_queue_name,
+                               const char *worker_name,
+                               amq_consumer_func_t *worker_func, void *cdata)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, supply_queue_name);
+   if (!queue)
+      return false;
+
+   return worker_start (worker_create (worker_name, queue, WORKER_TASK_CONSUMER,
+                                       worker_func, cdata), NULL);
+}
+
+bool amq_batch_consumer_create (const char *supply_queue_name,
+                                const char *worker_name,
+                                amq_batch_consumer_func_t *worker_func,
+                                size_t max_batch, size_t max_wait_us,
+                                void *cdata)
+{
+   return amq_batch_consumer_create_ex (supply_queue_name, worker_name, worker_func,
+                                        max_batch, max_wait_us, cdata, NULL);
+}
+
+bool amq_batch_consumer_create_ex (const char *supply_queue_name,
+                                   const char *worker_name,
+                                   amq_batch_consumer_func_t *worker_func,
+                                   size_t max_batch, size_t max_wait_us,
+                                   void *cdata,
+                                   const struct amq_worker_attr_t *attr)
+{
+   struct amq_queue_t *queue = amq_container_find (g_queue_container, supply_queue_name);
    if (!queue)
       return false;
 
-   cmq_t *supply_queue = queue->cmq;
-   return worker_create (worker_name, supply_queue, WORKER_CONSUMER, worker_func, cdata);
+   struct worker_t *worker = worker_create (worker_name, queue, WORKER_BATCH_CONSUMER,
+                                            worker_func, cdata);
+   if (!worker)
+      return false;
+
+   worker->batch_max = max_batch ? max_batch : 1;
+   worker->batch_wait_us = max_wait_us;
+   worker->batch = calloc (worker->batch_max, sizeof *worker->batch);
+   worker->batch_posted_ns = calloc (worker->batch_max, sizeof *worker->batch_posted_ns);
+   if (!worker->batch || !worker->batch_posted_ns) {
+      AMQ_ERROR_POST (-1, "Out of memory error: Failed to allocate batch of %zu\n",
+                          worker->batch_max);
+      worker_free (worker);
+      return false;
+   }
+
+   return worker_start (worker, attr);
+}
+
+bool amq_consumer_create_multi (const char **queue_names, const size_t *weights,
+                                size_t nqueues, enum amq_multi_policy_t policy,
+                                const char *worker_name,
+                                amq_multi_consumer_func_t *worker_func, void *cdata)
+{
+   if (!queue_names || !nqueues) {
+      AMQ_ERROR_POST (-1, "Cannot create multi-queue consumer [%s] without queues\n",
+                          worker_name ? worker_name : "");
+      return false;
+   }
+
+   struct worker_t *worker = worker_create (worker_name, NULL, WORKER_MULTI_CONSUMER,
+                                            worker_func, cdata);
+   if (!worker)
+      return false;
+
+   worker->multi_policy = policy;
+   if (!(worker->multi = calloc (nqueues, sizeof *worker->multi))) {
+      AMQ_ERROR_POST (-1, "Out of memory error: Failed to allocate %zu queues\n", nqueues);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<nqueues; i++) {
+      struct amq_queue_t *queue = amq_container_find (g_queue_container, queue_names[i]);
+      if (!queue) {
+         AMQ_ERROR_POST (-1, "Cannot attach [%s] to queue [%s]: no such queue\n",
+                             worker->worker_name, queue_names[i] ? queue_names[i] : "");
+         goto errorexit;
+      }
+      if (!(queue_attach (queue))) {
+         AMQ_ERROR_POST (-1, "Cannot attach [%s] to queue [%s]: a single-consumer queue "
+                             "already has a consumer\n", worker->worker_name, queue->name);
+         goto errorexit;
+      }
+
+      struct multi_source_t *source = &worker->multi[worker->nmulti++];
+      source->queue = queue;
+      source->weight = weights && weights[i] ? weights[i] : 1;
+      source->listener.seq = &worker->multi_seq;
+      source->listener.waiting = &worker->multi_waiting;
+      queue_add_listener (queue, &source->listener);
+   }
+
+   return worker_start (worker, NULL);
+
+errorexit:
+   worker_free (worker);
+   return false;
 }
 
 void amq_worker_sigset (const char *worker_name, uint64_t signals)
@@ -505,12 +3348,43 @@ uint64_t amq_worker_sigget (const char *worker_name)
    return worker_sigget (worker);
 }
 
+bool amq_worker_stats_get (const char *worker_name, struct amq_stats_t *stats)
+{
+   struct worker_t *worker = amq_container_find (g_worker_container, worker_name);
+   if (!worker || !stats)
+      return false;
+
+   stats_snapshot (&worker->stats, stats);
+   return true;
+}
+
+uint64_t amq_worker_sigwait (const char *worker_name, uint64_t sigmask, size_t timeout_us)
+{
+   // The worker can finish, and be removed, while we sleep.
+   amq_epoch_enter ();
+   struct worker_t *worker = amq_container_find (g_worker_container, worker_name);
+   bool found = worker && worker_ref (worker);
+   amq_epoch_exit ();
+
+   if (!found)
+      return 0;
+
+   uint64_t ret = worker_sigwait (worker, sigmask, timeout_us);
+   worker_unref (worker);
+   return ret;
+}
+
 void amq_worker_wait (const char *worker_name)
 {
    struct worker_t *worker = amq_container_find (g_worker_container, worker_name);
    if (!worker)
       return;
 
+   if (worker->worker_type == WORKER_TASK_CONSUMER) {
+      executor_wait (worker_name);
+      return;
+   }
+
    pthread_join (worker->worker_id, NULL);
 }
 
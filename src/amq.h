@@ -38,42 +38,75 @@
  * library initialisation. Errors are posted as a (struct amq_error_t *).
  *
  * The caller must have a consumer worker retrieve the error off the queue.
- * If errors are not retrieved the queue will gradually fill up until it
- * consumes all memory.
+ * The queue is a ring of AMQ_ERROR_POOL_SIZE errors; if errors are not
+ * retrieved it fills up, and further errors are dropped (and counted, see
+ * below) rather than blocking the code that reported them.
  *
  * More than one consumer can listen on the AMQ_QUEUE_ERROR queue. The consumer
  * must free the error using amq_error_del(). Any worker may post to this queue
- * using the wrapper function amq_error_new().
+ * using AMQ_ERROR_POST().
+ *
+ * Reporting an error never allocates: error objects come from a fixed pool and
+ * the message is formatted on the caller's stack, truncated to fit in
+ * AMQ_ERROR_MESSAGE_SIZE bytes. So that an error storm (the same failure on
+ * every file in a tree, say) costs next to nothing, every AMQ_ERROR_POST() call
+ * site reports at most AMQ_ERROR_SITE_RATE errors a second, and a message that
+ * is identical to the last one reported from the same call site in the same
+ * second is not reported again. Errors that are held back, or dropped because
+ * the pool or queue is full, are counted in the repeats field of the next error
+ * reported from the same call site.
  */
-#define AMQ_ERROR_POST(code,...)    {\
-   struct amq_error_t *errobj = amq_error_new (__FILE__, __LINE__, code, __VA_ARGS__);\
-   if (errobj) {\
-      amq_post (AMQ_QUEUE_ERROR, errobj, 0);\
-   } else {\
-      AMQ_PRINT ("Failed to create error object\n" __VA_ARGS__);\
-   }\
+#define AMQ_ERROR_POOL_SIZE         (256)
+#define AMQ_ERROR_MESSAGE_SIZE      (256)
+#define AMQ_ERROR_SITE_RATE         (10)
+
+// The state of a single AMQ_ERROR_POST() call site.
+struct amq_error_site_t {
+   uint64_t    window_ns;     // Start of the current one-second window
+   uint32_t    nposted;       // Errors reported in the current window
+   uint32_t    last_hash;     // Hash of the last message reported
+   uint32_t    repeats;       // Errors held back since the last one reported
+};
+
+#define AMQ_ERROR_POST(code,...)    do {\
+   static struct amq_error_site_t amq_error_site_;\
+   amq_error_post (&amq_error_site_, __FILE__, __LINE__, code, __VA_ARGS__);\
 } while (0)
 
 #define AMQ_QUEUE_ERROR    ("AMQ:ERROR")
 struct amq_error_t {
-   int   code;
-   char *message;
+   int      code;
+   char    *message;
+   size_t   repeats;    // Errors from the same call site held back before this one
+   char     text[AMQ_ERROR_MESSAGE_SIZE];   // The storage for message
 };
 #ifdef __cplusplus
 extern "C" {
 #endif
+// Returns an error from the pool, or NULL if the pool is empty. Most callers want
+// AMQ_ERROR_POST() instead, which also applies the rate limit.
 struct amq_error_t *amq_error_new (const char *file, int line, int code, ...);
 void amq_error_del (struct amq_error_t *errobj);
+void amq_error_post (struct amq_error_site_t *site, const char *file, int line,
+                     int code, ...);
 #ifdef __cplusplus
 };
 #endif
 
+// A snapshot of a consumer's message latency, which is the time from a message
+// being posted to the consumer receiving it. All times are in nanoseconds. The
+// percentiles come from a log-linear histogram and are accurate to within about
+// 6%; the count, minimum, maximum, mean and standard deviation are exact.
 struct amq_stats_t {
-   size_t   count;
-   float    min;
-   float    max;
-   float    average;
-   float    deviation;
+   uint64_t   count;
+   uint64_t   min_ns;
+   uint64_t   max_ns;
+   double     mean_ns;
+   double     stddev_ns;
+   uint64_t   p50_ns;
+   uint64_t   p90_ns;
+   uint64_t   p99_ns;
+   uint64_t   p999_ns;
 };
 
 struct amq_worker_t {
@@ -81,9 +114,63 @@ struct amq_worker_t {
    char                 *worker_name;
    void                 *worker_cdata;
    uint8_t               worker_type;
-   struct amq_stats_t    stats;
 };
 
+// The engines that can back a message queue. See amq_message_queue_create_ex().
+enum amq_queue_engine_t {
+   amq_queue_engine_CMQ,
+   amq_queue_engine_RING,
+   amq_queue_engine_SPSC,
+   amq_queue_engine_STEAL,
+   amq_queue_engine_INTRUSIVE,
+   amq_queue_engine_INLINE,
+};
+
+// Every message posted to an amq_queue_engine_INTRUSIVE queue must start with this
+// header, normally by making it the first member of the message struct. The queue
+// links messages through the header instead of allocating a node for each one, and
+// fills in all three fields when the message is posted; a message must not be
+// posted again, or touched, while it is still queued.
+typedef struct amq_msg_hdr_t amq_msg_hdr_t;
+struct amq_msg_hdr_t {
+   struct amq_msg_hdr_t   *next;
+   size_t                  length;        // The buf_len that was posted
+   uint64_t                timestamp_ns;  // CLOCK_MONOTONIC time of the post
+};
+
+// The capacity used for bounded engines when the caller specifies a capacity of 0.
+#define AMQ_QUEUE_DEFAULT_CAPACITY     (4096)
+
+// The largest message that an inline queue created with amq_message_queue_create_ex()
+// can hold. See amq_message_queue_create_inline().
+#define AMQ_QUEUE_DEFAULT_INLINE_SIZE  (64)
+
+// The outcome of posting a message. Unless the result is amq_post_result_OK or
+// amq_post_result_DROPPED, the message was not queued and the caller still owns it.
+enum amq_post_result_t {
+   amq_post_result_OK,
+   amq_post_result_FULL,         // The queue was full and the post did not wait
+   amq_post_result_TIMEOUT,      // The queue stayed full for the whole timeout
+   amq_post_result_DROPPED,      // The message was handed to the discard function
+   amq_post_result_ERROR,        // The queue does not exist
+};
+
+// What amq_post() does when a queue is at its limit. See amq_queue_set_limit().
+enum amq_post_policy_t {
+   amq_post_policy_BLOCK,        // Wait for a consumer to make space (the default)
+   amq_post_policy_DROP_NEWEST,  // Discard the message being posted
+   amq_post_policy_DROP_OLDEST,  // Discard the oldest message in the queue
+   amq_post_policy_FAIL,         // Return amq_post_result_FULL
+};
+
+// Called with messages that a queue discards because of its post policy. The
+// function takes ownership of the message.
+typedef void (amq_discard_func_t) (void *buf, size_t buf_len);
+
+// Allocates a buffer of size bytes for a message on the named queue. See
+// amq_queue_set_spill(); amq_msg_alloc() has this type.
+typedef void *(amq_alloc_func_t) (const char *queue_name, size_t size);
+
 enum amq_worker_result_t {
    amq_worker_result_CONTINUE,
    amq_worker_result_STOP,
@@ -95,7 +182,50 @@ typedef enum amq_worker_result_t (amq_consumer_func_t) (const struct amq_worker_
                                                         void *mesg, size_t mesg_len,
                                                         void *cdata);
 
+// A single message, as passed to batch consumers.
+struct amq_message_t {
+   void    *mesg;
+   size_t   mesg_len;
+};
+
+typedef enum amq_worker_result_t (amq_batch_consumer_func_t) (const struct amq_worker_t *self,
+                                                              struct amq_message_t *mesgs,
+                                                              size_t nmesgs,
+                                                              void *cdata);
+
+// How a multi-queue consumer chooses the queue to take its next message from. See
+// amq_consumer_create_multi().
+enum amq_multi_policy_t {
+   amq_multi_policy_WEIGHTED,    // Weighted round-robin over the queues
+   amq_multi_policy_PRIORITY,    // The first queue in the list that has a message
+};
+
+typedef enum amq_worker_result_t (amq_multi_consumer_func_t) (const struct amq_worker_t *self,
+                                                              const char *queue_name,
+                                                              void *mesg, size_t mesg_len,
+                                                              void *cdata);
+
+// Thread attributes for a worker, passed to the _ex worker creation functions.
+// Initialise with AMQ_WORKER_ATTR_INIT and set only the fields that are needed.
+struct amq_worker_attr_t {
+   const int   *cpus;         // The CPUs the worker may run on, or NULL for any
+   size_t       ncpus;
+   int          numa_node;    // Run on, and prefer memory from, this node; -1 for any.
+                              // When cpus is also given only the CPUs that are on the
+                              // node are used.
+   size_t       stack_size;   // In bytes, or 0 for the default
+   bool         realtime;     // Use SCHED_FIFO, usually needs privileges
+   int          priority;     // The SCHED_FIFO priority if realtime, else the nice value
+};
+
+#define AMQ_WORKER_ATTR_INIT     { NULL, 0, -1, 0, false, 0 }
+
 typedef struct amq_t amq_t;
+typedef struct amq_queue_t amq_queue_t;
+
+// An interned name, returned by amq_intern(). It is an ordinary string and can be
+// passed anywhere a queue or worker name is accepted.
+typedef const char *amq_name_t;
 
 #ifdef __cplusplus
 extern "C" {
@@ -115,6 +245,17 @@ extern "C" {
    bool amq_lib_init (void);
    void amq_lib_destroy (void);
 
+   // Intern a queue or worker name. Interning the same string again returns the same
+   // pointer. The hash and length of an interned name are computed once, here, so
+   // looking up a queue or worker by an interned name does not walk the string.
+   // Interned names are never freed, and remain valid after amq_lib_destroy(); intern
+   // long-lived names, not names created per message. This may be called before
+   // amq_lib_init(), and from any thread.
+   //
+   // Returns NULL if out of memory, or if the 16MiB of space for interned names has
+   // been used up.
+   amq_name_t amq_intern (const char *name);
+
    // Once the calling application has called amq_lib_init(), the following functions
    // are available.
 
@@ -123,12 +264,298 @@ extern "C" {
    // message queue.
    bool amq_message_queue_create (const char *name);
 
-   // Post a message to a message queue
-   void amq_post (const char *queue_name, void *buf, size_t buf_len);
+   // Create a new message queue backed by a specific engine. amq_message_queue_create()
+   // is the same as calling this function with amq_queue_engine_CMQ.
+   //
+   //    amq_queue_engine_CMQ    An unbounded queue from libcmq. The capacity is
+   //                            ignored.
+   //    amq_queue_engine_RING   A bounded lock-free ring that can hold capacity
+   //                            messages (rounded up to a power of two). Posting to a
+   //                            full ring blocks until a consumer makes space, and
+   //                            consumers only sleep when the ring is empty. Do not
+   //                            use a bounded queue for a consumer that posts back
+   //                            onto its own queue; it can block forever.
+   //    amq_queue_engine_SPSC   A bounded wait-free ring for exactly one producer
+   //                            thread and one consumer. Behaves like the ring
+   //                            engine when full or empty. amq_consumer_create()
+   //                            fails if the queue already has a consumer; debug
+   //                            builds post an error when a second thread posts.
+   //    amq_queue_engine_STEAL  An unbounded work-stealing queue for consumers that
+   //                            post back onto their own queue, such as tree walks.
+   //                            Every consumer has a deque of capacity messages
+   //                            (rounded up to a power of two); a consumer's own
+   //                            posts go onto its deque and it takes from there
+   //                            first, newest first. Other posts, and posts that
+   //                            overflow a deque, go to a shared cmq queue. A
+   //                            consumer with nothing of its own or shared steals
+   //                            the oldest message from another consumer's deque.
+   //                            At most 64 consumers can listen on such a queue.
+   //    amq_queue_engine_INTRUSIVE
+   //                            An unbounded queue of messages that start with an
+   //                            amq_msg_hdr_t, linked through that header, so that
+   //                            neither posting nor consuming allocates. Posting a
+   //                            NULL message returns amq_post_result_ERROR, and
+   //                            amq_post_many() stops at the first NULL message.
+   //                            The capacity is ignored.
+   //    amq_queue_engine_INLINE A bounded ring like amq_queue_engine_RING, except
+   //                            that messages are copied into the ring's own
+   //                            storage with amq_post_copy(); see
+   //                            amq_message_queue_create_inline(). Messages can
+   //                            be up to AMQ_QUEUE_DEFAULT_INLINE_SIZE bytes.
+   //
+   // Returns true on success and false on error.
+   bool amq_message_queue_create_ex (const char *name,
+                                     enum amq_queue_engine_t engine, size_t capacity);
+
+   // Create an amq_queue_engine_INLINE queue with room for capacity messages (rounded
+   // up to a power of two) of up to max_msg_size bytes each, stored contiguously.
+   // This suits small messages, such as ids or short strings, for which allocating
+   // and freeing each message costs more than copying it.
+   //
+   // Messages are posted with amq_post_copy(), which copies them in; the caller
+   // keeps its buffer. A consumer is passed a pointer into the queue's storage that
+   // is only valid until its callback returns, and must not free it. The other
+   // amq_post functions cannot be used on an inline queue and return
+   // amq_post_result_ERROR (or 0).
+   //
+   // A message stays in its slot while a consumer's callback runs, so a slow
+   // consumer holds up producers once they have gone all the way around the ring.
+   bool amq_message_queue_create_inline (const char *name, size_t capacity,
+                                         size_t max_msg_size);
+
+   // Create an inline queue (see amq_message_queue_create_inline()) in POSIX shared
+   // memory, so that processes that create a queue of the same name share it. The
+   // first process to do so creates the shared-memory object "/amq.<name>" with room
+   // for capacity messages of up to slot_size bytes; later processes attach to it,
+   // ignore capacity, and fail if slot_size is larger than the existing slots. A
+   // capacity or slot_size of 0 uses the defaults. Names may not contain '/'.
+   //
+   // Producers post with amq_post_copy(), and consumers created with
+   // amq_consumer_create() or amq_batch_consumer_create() in any process take the
+   // messages; producers and consumers sleep on shared futexes, so either side is
+   // woken by the other process. Task consumers and multi-queue consumers only
+   // notice posts made in their own process, and limits set with
+   // amq_queue_set_limit() apply to this process's posts only.
+   //
+   // The object outlives every process that uses it, messages included, until it is
+   // removed with amq_message_queue_unlink_shm(). A process that dies part-way
+   // through a post or a take can leave the queue stuck; unlink and re-create it.
+   //
+   // Only supported on Linux; elsewhere this posts ENOSYS and returns false.
+   bool amq_message_queue_create_shm (const char *name, size_t capacity,
+                                      size_t slot_size);
+
+   // Remove the shared-memory object behind a queue created with
+   // amq_message_queue_create_shm(). Processes that have the queue keep using it,
+   // but a later amq_message_queue_create_shm() creates a new, empty queue.
+   bool amq_message_queue_unlink_shm (const char *name);
+
+   // Limit a message queue to high_water messages, and choose what amq_post() does
+   // when the limit is reached. A high_water of 0 removes the limit, leaving only
+   // the capacity of the engine. discard_func, which may be NULL, is called for every
+   // message dropped by amq_post_policy_DROP_NEWEST or amq_post_policy_DROP_OLDEST,
+   // except on inline queues (see amq_post_copy()).
+   //
+   // The limit is checked before each post, so concurrent producers may overshoot it
+   // by a message or two; the capacity of the bounded engines is never exceeded. It
+   // may be changed while producers are posting, and applies to their next post.
+   // The discard function is changed before the policy, so a producer may give a
+   // message that the old policy drops to the new discard function.
+   //
+   // amq_post_policy_DROP_OLDEST cannot be used with amq_queue_engine_SPSC, as the
+   // producer would have to remove messages from the queue.
+   //
+   // Returns false if the queue does not exist or the policy is not supported.
+   bool amq_queue_set_limit (const char *queue_name, size_t high_water,
+                             enum amq_post_policy_t policy,
+                             amq_discard_func_t *discard_func);
+
+   // Spill messages to disk instead of holding them in memory while a queue's
+   // consumers fall behind. Once the queue holds high_water messages, each message
+   // posted with a buf_len greater than 0 is copied (buf_len bytes of it) to the end
+   // of a log of segment files in dir, and its buffer is released with release_func.
+   // When consumers drain the queue to low_water messages, the log is read back in
+   // order, with read-ahead, into buffers from alloc_func, until the queue is at
+   // high_water again. While anything is in the log, new messages go to the log as
+   // well, so the queue stays in posting order; messages with a buf_len of 0 cannot
+   // be spilled and go straight into the queue, ahead of any spilled messages.
+   //
+   // Consumers cannot tell a message that was read back from one that never left
+   // memory, so alloc_func and release_func must match the buffers that producers
+   // post: for buffers from amq_msg_alloc(), pass amq_msg_alloc and a function that
+   // calls amq_msg_release(); for buffers from malloc(), functions that call malloc()
+   // and free(). Both are required.
+   //
+   // Only amq_queue_engine_CMQ and amq_queue_engine_RING queues can spill, and
+   // high_water must be larger than low_water and no larger than the queue's
+   // capacity. A limit set with amq_queue_set_limit() applies first, so it should
+   // be above high_water. If a message cannot be written to the log, for example
+   // because the disk is full, an error is posted and the message goes into the
+   // queue in memory. amq_count() includes spilled messages.
+   //
+   // Segment files are named after the process and the queue, and are deleted once
+   // read back, or with any messages still in them when the queue is deleted.
+   // Spilling cannot be turned off again. Returns false on error.
+   bool amq_queue_set_spill (const char *queue_name, const char *dir,
+                             size_t high_water, size_t low_water,
+                             amq_alloc_func_t *alloc_func,
+                             amq_discard_func_t *release_func);
+
+   // Post a message to a message queue. When the queue is at its limit this follows
+   // the queue's post policy, which by default waits for space.
+   enum amq_post_result_t amq_post (const char *queue_name, void *buf, size_t buf_len);
+
+   // Post a message without waiting, regardless of the queue's policy. Returns
+   // amq_post_result_FULL if the queue is at its limit.
+   enum amq_post_result_t amq_post_try (const char *queue_name, void *buf, size_t buf_len);
+
+   // Post a message, waiting at most timeout_us microseconds for space, regardless
+   // of the queue's policy. Returns amq_post_result_TIMEOUT if there was no space.
+   enum amq_post_result_t amq_post_timed (const char *queue_name, void *buf, size_t buf_len,
+                                          size_t timeout_us);
+
+   // Post nbufs messages to a message queue, in order. The lengths are taken from
+   // buf_lens, which may be NULL if all the lengths are zero. Waiting consumers are
+   // woken once for the whole run rather than once per message, and the ring and spsc
+   // engines claim space for the whole run in a single operation where possible.
+   //
+   // Returns the number of messages posted. With amq_post_policy_FAIL the caller
+   // still owns the messages from that index onwards; with
+   // amq_post_policy_DROP_NEWEST they have been passed to the discard function. If
+   // a message could not be queued at all, for example because memory ran out,
+   // posting stops there and the caller owns it and the messages after it.
+   size_t amq_post_many (const char *queue_name, void **bufs, size_t *buf_lens,
+                         size_t nbufs);
+
+   // Copy buf_len bytes from buf into an inline queue (see
+   // amq_message_queue_create_inline()), following the queue's policy when it is
+   // full. The caller keeps ownership of buf, so amq_post_policy_DROP_NEWEST does
+   // not call the discard function, and neither does amq_post_policy_DROP_OLDEST,
+   // as the message it drops is in the queue's own storage. Returns
+   // amq_post_result_ERROR if the queue is not an inline queue or buf_len is larger
+   // than its maximum message size.
+   enum amq_post_result_t amq_post_copy (const char *queue_name, const void *buf,
+                                         size_t buf_len);
 
    // Returns the number of elements in the specified queue.
    size_t amq_count (const char *queue_name);
 
+   // Allocate a buffer of size bytes for a message to be posted to the queue. The
+   // buffer comes from a cache that belongs to both the queue and the calling thread,
+   // so allocating does not take a lock or, once the cache has warmed up, call
+   // malloc(). Buffers larger than 8KiB are allocated with malloc().
+   //
+   // The consumer, or whoever ends up with the message, must release the buffer with
+   // amq_msg_release() and not with free(). It may be released from any thread; a
+   // buffer released by a thread other than the one that allocated it is returned to
+   // its cache in batches. Every buffer must be released before amq_lib_destroy() is
+   // called.
+   //
+   // Returns NULL if the queue does not exist or if out of memory.
+   void *amq_msg_alloc (const char *queue_name, size_t size);
+   void amq_msg_release (void *buf);
+
+   // Hand back the buffers that the calling thread has released but that are still
+   // waiting in its batch. Workers do this before they sleep and when they exit, and
+   // amq_try_take() does it when it finds the queue empty, so only a thread that
+   // releases buffers in other ways, and then stops releasing them for a while,
+   // needs to call this; otherwise up to a batch of buffers stays out of use.
+   void amq_msg_flush (void);
+
+   // Take a message from the queue without waiting, so that a thread that is not a
+   // worker, such as an event loop, can consume from the queue. The message then
+   // belongs to the caller, as it would to a consumer. On a spsc queue the caller
+   // counts as the consumer, so the queue must not also have a consumer worker. Inline
+   // queues cannot be taken from in this way, as their messages stay in the queue's
+   // storage.
+   //
+   // Returns true if a message was taken, and false if the queue is empty or does not
+   // exist.
+   bool amq_try_take (const char *queue_name, void **buf, size_t *buf_len);
+
+   // Returns a file descriptor that is readable while the queue has messages, for use
+   // with poll(), epoll or kqueue alongside sockets, or -1 on error. The descriptor is
+   // created on first use and belongs to the queue; the caller must not read from it or
+   // close it.
+   //
+   // Posting makes the descriptor readable, and only amq_try_take() finding the queue
+   // empty makes it unreadable again, so a loop that is woken by the descriptor must
+   // call amq_try_take() until it returns false. If other consumers empty the queue
+   // the descriptor stays readable until then. Once a queue has a descriptor, a post
+   // that finds the descriptor unreadable costs one extra system call.
+   //
+   // Inline queues, which amq_try_take() cannot take from, have no descriptor; for
+   // them this posts EINVAL and returns -1.
+   int amq_queue_fd (const char *queue_name);
+
+   // Create a topic. A message published to a topic is posted to every queue that is
+   // subscribed to it at the time, without being copied: each subscriber gets the same
+   // pointer. Topics have names of their own, separate from the names of queues.
+   //
+   // Returns true on success and false on error.
+   bool amq_topic_create (const char *name);
+
+   // Subscribe a queue to a topic, or unsubscribe it. Intrusive and inline queues
+   // cannot subscribe, and neither can spsc queues, as any thread may publish. A
+   // publisher that has already started posting a message to the subscribers may
+   // still post it to a queue that has just unsubscribed.
+   //
+   // Returns false if either does not exist, or if the queue was already subscribed
+   // (for amq_topic_subscribe()) or was not (for amq_topic_unsubscribe()).
+   bool amq_topic_subscribe (const char *topic_name, const char *queue_name);
+   bool amq_topic_unsubscribe (const char *topic_name, const char *queue_name);
+
+   // Allocate a shared payload of size bytes, to be published to the topic. The
+   // payload carries a reference count and is allocated from the topic's own slab
+   // (see amq_msg_alloc()), so it is returned there rather than freed.
+   //
+   // Every consumer that is passed the payload owns one reference to it, and must
+   // release it with amq_shared_release() when it is done, and not with free(). The
+   // payload must not be changed once it has been published. Every payload must be
+   // released before amq_lib_destroy() is called.
+   //
+   // Returns NULL if the topic does not exist or if out of memory.
+   void *amq_shared_alloc (const char *topic_name, size_t size);
+   void amq_shared_release (void *buf);
+
+   // Post a shared payload from amq_shared_alloc() to every queue that is subscribed
+   // to the topic, as amq_post() would, so each queue's full-queue policy applies and
+   // a full queue can block the publisher. The caller's reference is always given up,
+   // so a payload that was not posted to any queue has been released. A subscriber
+   // that drops messages must have a discard function that releases them.
+   //
+   // Returns the number of queues the payload was posted to.
+   size_t amq_publish (const char *topic_name, void *buf, size_t buf_len);
+
+   // Open a handle to an existing message queue. The name is resolved only once, when
+   // the handle is opened, so posting and counting through the handle never looks the
+   // queue up by name. The handle keeps the queue alive until it is closed with
+   // amq_queue_close(); every handle that is opened must be closed before
+   // amq_lib_destroy() is called.
+   //
+   // Returns NULL if the queue does not exist.
+   amq_queue_t *amq_queue_open (const char *queue_name);
+   void amq_queue_close (amq_queue_t *queue);
+
+   // Returns the name of the queue that the handle refers to.
+   const char *amq_queue_name (amq_queue_t *queue);
+
+   // The same as amq_post(), amq_post_try(), amq_post_timed(), amq_post_many(),
+   // amq_post_copy(), amq_count(), amq_msg_alloc(), amq_try_take() and amq_queue_fd(),
+   // but using a handle obtained from amq_queue_open() instead of the name of the queue.
+   enum amq_post_result_t amq_post_h (amq_queue_t *queue, void *buf, size_t buf_len);
+   enum amq_post_result_t amq_post_try_h (amq_queue_t *queue, void *buf, size_t buf_len);
+   enum amq_post_result_t amq_post_timed_h (amq_queue_t *queue, void *buf, size_t buf_len,
+                                            size_t timeout_us);
+   size_t amq_post_many_h (amq_queue_t *queue, void **bufs, size_t *buf_lens,
+                           size_t nbufs);
+   enum amq_post_result_t amq_post_copy_h (amq_queue_t *queue, const void *buf,
+                                           size_t buf_len);
+   size_t amq_count_h (amq_queue_t *queue);
+   void *amq_msg_alloc_h (amq_queue_t *queue, size_t size);
+   bool amq_try_take_h (amq_queue_t *queue, void **buf, size_t *buf_len);
+   int amq_queue_fd_h (amq_queue_t *queue);
+
    // Create a new producer thread, with an optional name. Name can be specified as NULL
    // or an empty string. The cdata will be passed unchanged to the worker.
    //
@@ -147,6 +574,97 @@ extern "C" {
                              const char *worker_name,
                              amq_consumer_func_t *worker_func, void *cdata);
 
+   // Start the executor that runs task consumers on a fixed pool of nthreads threads.
+   // If nthreads is 0 one thread is started per online CPU. If the executor is not
+   // running, the first call to amq_task_consumer_create() starts it with an nthreads
+   // of 0. The executor is stopped by amq_lib_destroy(); calling this while it is
+   // running does nothing.
+   //
+   // Returns true if the executor is running, false otherwise. All errors are posted
+   // to the AMQ_QUEUE_ERROR message queue.
+   bool amq_executor_start (size_t nthreads);
+
+   // Create a new consumer that runs as a task on the executor rather than on a
+   // thread of its own. It is called in exactly the same way as a consumer created
+   // with amq_consumer_create(), but costs no thread or stack while its queue is
+   // empty, so hundreds of mostly-idle consumers can share a handful of threads.
+   //
+   // A task is run on whichever executor thread is free, though never on two at once,
+   // and self->worker_id is the id of the thread currently running it. A task that
+   // blocks, for example by posting to a full queue, holds up an executor thread for
+   // as long as it blocks.
+   //
+   // Returns true if the consumer was created, false otherwise. All errors are posted
+   // to the AMQ_QUEUE_ERROR message queue.
+   bool amq_task_consumer_create (const char *supply_queue_name,
+                                  const char *worker_name,
+                                  amq_consumer_func_t *worker_func, void *cdata);
+
+   // Create a new consumer thread that is passed messages in batches. The worker waits
+   // for a message to arrive and then keeps collecting messages until it has max_batch
+   // of them, or until max_wait_us microseconds have passed since the first one
+   // arrived, whichever comes first. A max_wait_us of zero passes whatever is in the
+   // queue immediately. The worker_func is called once per batch, with between 1 and
+   // max_batch messages. The mesgs array belongs to the library and is reused for the
+   // next batch; the messages themselves belong to the worker, as with
+   // amq_consumer_create().
+   //
+   // On the ring and spsc engines the messages in a batch are claimed from the queue
+   // in a single operation where possible.
+   //
+   // Returns true if the consumer was created, false otherwise. All errors are posted
+   // to the AMQ_QUEUE_ERROR message queue.
+   bool amq_batch_consumer_create (const char *supply_queue_name,
+                                   const char *worker_name,
+                                   amq_batch_consumer_func_t *worker_func,
+                                   size_t max_batch, size_t max_wait_us,
+                                   void *cdata);
+
+   // Create a new consumer thread that takes messages from nqueues queues, so that
+   // a stage fed by several queues needs one thread rather than one per queue. The
+   // worker sleeps until any of the queues named in queue_names has a message, and
+   // worker_func is passed the name of the queue that each message came from. The
+   // messages belong to the worker, as with amq_consumer_create().
+   //
+   // With amq_multi_policy_WEIGHTED the worker takes up to weights[i] messages in a
+   // row from queue i before moving on to the next queue, skipping queues that are
+   // empty, so that a busy queue gets a share of the worker in proportion to its
+   // weight. weights may be NULL to give every queue a weight of 1, and a weight of
+   // 0 is taken as 1. With amq_multi_policy_PRIORITY the worker always takes from
+   // the first queue in queue_names that has a message, so a queue is only served
+   // while the ones before it are empty; weights is ignored.
+   //
+   // Returns true if the consumer was created, false otherwise. All errors are posted
+   // to the AMQ_QUEUE_ERROR message queue.
+   bool amq_consumer_create_multi (const char **queue_names, const size_t *weights,
+                                   size_t nqueues, enum amq_multi_policy_t policy,
+                                   const char *worker_name,
+                                   amq_multi_consumer_func_t *worker_func, void *cdata);
+
+   // The same as amq_producer_create(), amq_consumer_create() and
+   // amq_batch_consumer_create(), but the worker's thread is created with the
+   // attributes in attr, which may be NULL. Creation fails if the stack size, CPUs,
+   // NUMA node or real-time priority cannot be applied. The nice value and NUMA
+   // memory policy can only be applied by the running thread, so if they fail an
+   // error is posted but the worker keeps running. CPU affinity, NUMA placement and
+   // the nice value are only supported on Linux, and are ignored elsewhere.
+   //
+   // Every worker thread is named after its worker (truncated to 15 characters on
+   // Linux) so that it can be told apart in top -H, perf and debuggers.
+   bool amq_producer_create_ex (const char *worker_name,
+                                amq_producer_func_t *worker_func, void *cdata,
+                                const struct amq_worker_attr_t *attr);
+   bool amq_consumer_create_ex (const char *supply_queue_name,
+                                const char *worker_name,
+                                amq_consumer_func_t *worker_func, void *cdata,
+                                const struct amq_worker_attr_t *attr);
+   bool amq_batch_consumer_create_ex (const char *supply_queue_name,
+                                      const char *worker_name,
+                                      amq_batch_consumer_func_t *worker_func,
+                                      size_t max_batch, size_t max_wait_us,
+                                      void *cdata,
+                                      const struct amq_worker_attr_t *attr);
+
    // Set and clear specific signals for a worker. See the #defines for values that
    // can be bitwise-ORed into sigmask.
    void amq_worker_sigset (const char *worker_name, uint64_t sigmask);
@@ -155,6 +673,22 @@ extern "C" {
    // Get the current sigmask for a worker.
    uint64_t amq_worker_sigget (const char *worker_name);
 
+   // Get a consistent snapshot of a worker's latency statistics. This may be called
+   // from any thread, including the worker itself, while the worker is running.
+   // Producers have no statistics, and always report a count of zero.
+   //
+   // Returns false if the worker does not exist.
+   bool amq_worker_stats_get (const char *worker_name, struct amq_stats_t *stats);
+
+   // Wait until at least one of the signals in sigmask is set for a worker, or until
+   // timeout_us microseconds have passed; a timeout of (size_t)-1 waits forever.
+   // AMQ_SIGNAL_TERMINATE always ends the wait. Returns the signals that were set for
+   // the worker when the wait ended, as amq_worker_sigget() would, or 0 if the worker
+   // does not exist or finishes during the wait. This may be called from any thread,
+   // including the worker itself, using self->worker_name.
+   uint64_t amq_worker_sigwait (const char *worker_name, uint64_t sigmask,
+                                size_t timeout_us);
+
    // Wait for a worker to finish: this function will only return when a worker returns!
    // If a worker never returns, then waiting for that worker will wait indefinitely.
    void amq_worker_wait (const char *worker_name);
@@ -0,0 +1,564 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "amq.h"
+
+/* ************************************************************
+ * A benchmark for the library. Each scenario runs some producers, each
+ * posting a fixed number of messages to a single queue, and some consumers
+ * draining it. The results go to stdout as one JSON object per scenario per
+ * line, so that they can be collected and compared across releases:
+ *
+ *    msgs_per_sec      Messages consumed per second of wall-clock time,
+ *                      from the producers starting to the last message.
+ *    p50_ns, p99_ns    Post-to-consume latency, over all consumers.
+ *    cpu_ns_per_msg    User plus system CPU time per message.
+ *    peak_rss_kb       Peak resident set size of the process.
+ *
+ * Without arguments the whole suite runs, each scenario in a child process
+ * of its own so that peak RSS is per scenario. Run with --help for the
+ * options.
+ */
+#define BENCH_QUEUE           ("BENCH:QUEUE")
+#define BENCH_MESSAGES        (100000)
+#define BENCH_MAX_WORKERS     (64)
+
+#ifndef amq_version
+#define amq_version           "unknown"
+#endif
+
+struct scenario_t {
+   const char             *name;
+   enum amq_queue_engine_t engine;
+   const char             *consumer;     // "thread", "batch" or "task"
+   size_t                  nproducers;
+   size_t                  nconsumers;
+   size_t                  size;         // Bytes per message
+   size_t                  batch;        // Messages per post; 1 for single posts
+   size_t                  suspend_us;   // Suspend/resume period, 0 for none
+};
+
+static const struct scenario_t g_suite[] = {
+   { "cmq-1x1",            amq_queue_engine_CMQ,        "thread", 1, 1, 64,   1,  0 },
+   { "cmq-4x4",            amq_queue_engine_CMQ,        "thread", 4, 4, 64,   1,  0 },
+   { "cmq-4x4-batch",      amq_queue_engine_CMQ,        "batch",  4, 4, 64,   32, 0 },
+   { "ring-1x1",           amq_queue_engine_RING,       "thread", 1, 1, 64,   1,  0 },
+   { "ring-4x4",           amq_queue_engine_RING,       "thread", 4, 4, 64,   1,  0 },
+   { "ring-4x4-batch",     amq_queue_engine_RING,       "batch",  4, 4, 64,   32, 0 },
+   { "ring-4x4-task",      amq_queue_engine_RING,       "task",   4, 4, 64,   1,  0 },
+   { "ring-4x4-1k",        amq_queue_engine_RING,       "thread", 4, 4, 1024, 1,  0 },
+   { "spsc-1x1",           amq_queue_engine_SPSC,       "thread", 1, 1, 64,   1,  0 },
+   { "spsc-1x1-batch",     amq_queue_engine_SPSC,       "batch",  1, 1, 64,   32, 0 },
+   { "steal-4x4",          amq_queue_engine_STEAL,      "thread", 4, 4, 64,   1,  0 },
+   { "intrusive-4x4",      amq_queue_engine_INTRUSIVE,  "thread", 4, 4, 64,   1,  0 },
+   { "intrusive-4x4-batch",amq_queue_engine_INTRUSIVE,  "batch",  4, 4, 64,   32, 0 },
+   { "inline-4x4",         amq_queue_engine_INLINE,     "thread", 4, 4, 64,   1,  0 },
+   { "ring-2x2-suspend",   amq_queue_engine_RING,       "thread", 2, 2, 64,   1,  1000 },
+};
+#define SUITE_SIZE      (sizeof g_suite / sizeof g_suite[0])
+
+static const struct {
+   const char              *name;
+   enum amq_queue_engine_t  engine;
+} g_engines[] = {
+   { "cmq",       amq_queue_engine_CMQ },
+   { "ring",      amq_queue_engine_RING },
+   { "spsc",      amq_queue_engine_SPSC },
+   { "steal",     amq_queue_engine_STEAL },
+   { "intrusive", amq_queue_engine_INTRUSIVE },
+   { "inline",    amq_queue_engine_INLINE },
+};
+#define NENGINES        (sizeof g_engines / sizeof g_engines[0])
+
+static const char *engine_name (enum amq_queue_engine_t engine)
+{
+   for (size_t i=0; i<NENGINES; i++) {
+      if (g_engines[i].engine == engine)
+         return g_engines[i].name;
+   }
+   return "unknown";
+}
+
+static uint64_t clock_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ************************************************************
+ * Latency histogram, with the same log-linear buckets as the library's
+ * worker statistics. Each consumer has its own, and they are merged at the
+ * end.
+ */
+#define HIST_SUB_BITS      (4)
+#define HIST_SUB_COUNT     (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS      (40)
+#define HIST_NBUCKETS      ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct hist_t {
+   uint64_t    count;
+   uint64_t    buckets[HIST_NBUCKETS];
+};
+
+static size_t hist_bucket (uint64_t ns)
+{
+   if (ns < HIST_SUB_COUNT)
+      return ns;
+
+   size_t msb = 63 - __builtin_clzll (ns);
+   if (msb >= HIST_MAX_BITS)
+      return HIST_NBUCKETS - 1;
+
+   size_t sub = (ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1);
+   return (msb - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + sub;
+}
+
+static uint64_t hist_bucket_max (size_t index)
+{
+   if (index < HIST_SUB_COUNT)
+      return index;
+
+   size_t msb = index / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+   size_t sub = index % HIST_SUB_COUNT;
+   uint64_t width = (uint64_t)1 << (msb - HIST_SUB_BITS);
+   return ((uint64_t)1 << msb) + (sub + 1) * width - 1;
+}
+
+static void hist_add (struct hist_t *hist, uint64_t ns)
+{
+   hist->count++;
+   hist->buckets[hist_bucket (ns)]++;
+}
+
+static uint64_t hist_percentile (const struct hist_t *hist, double pct)
+{
+   uint64_t rank = (uint64_t)(hist->count * pct / 100.0);
+   uint64_t seen = 0;
+   for (size_t i=0; i<HIST_NBUCKETS; i++) {
+      seen += hist->buckets[i];
+      if (seen > rank)
+         return hist_bucket_max (i);
+   }
+   return 0;
+}
+
+/* ************************************************************
+ * The run itself. Messages carry the time at which they were posted; the
+ * header is only used by the intrusive engine, but is always there so that
+ * every engine moves the same number of bytes.
+ */
+struct bench_msg_t {
+   amq_msg_hdr_t  hdr;
+   uint64_t       sent_ns;
+};
+
+static const struct scenario_t *g_scenario;
+static size_t g_messages;
+static amq_name_t g_queue;
+
+static uint64_t g_expected;
+static uint64_t g_consumed;
+static uint64_t g_end_ns;
+
+// Set by a producer that failed to post, which means that g_expected will
+// never be reached.
+static bool g_failed;
+
+static struct hist_t g_hists[BENCH_MAX_WORKERS];
+
+static void consume (struct hist_t *hist, void *mesg)
+{
+   struct bench_msg_t *msg = mesg;
+   uint64_t now = clock_ns ();
+
+   hist_add (hist, now - msg->sent_ns);
+   if (g_scenario->engine != amq_queue_engine_INLINE)
+      amq_msg_release (msg);
+
+   if (__atomic_add_fetch (&g_consumed, 1, __ATOMIC_RELAXED) == g_expected)
+      __atomic_store_n (&g_end_ns, now, __ATOMIC_RELEASE);
+}
+
+static enum amq_worker_result_t bench_consumer (const struct amq_worker_t *self,
+                                                void *mesg, size_t mesg_len,
+                                                void *cdata)
+{
+   (void)self;
+   (void)mesg_len;
+
+   consume (cdata, mesg);
+   return amq_worker_result_CONTINUE;
+}
+
+static enum amq_worker_result_t bench_batch_consumer (const struct amq_worker_t *self,
+                                                      struct amq_message_t *mesgs,
+                                                      size_t nmesgs, void *cdata)
+{
+   (void)self;
+
+   for (size_t i=0; i<nmesgs; i++) {
+      consume (cdata, mesgs[i].mesg);
+   }
+   return amq_worker_result_CONTINUE;
+}
+
+static struct bench_msg_t *msg_new (void)
+{
+   struct bench_msg_t *ret = amq_msg_alloc (g_queue, g_scenario->size);
+   if (ret)
+      ret->sent_ns = clock_ns ();
+   return ret;
+}
+
+static enum amq_worker_result_t producer_fail (const struct amq_worker_t *self,
+                                               void **bufs, size_t nbufs)
+{
+   fprintf (stderr, "Producer [%s]: failed to post a message\n", self->worker_name);
+   for (size_t i=0; i<nbufs; i++) {
+      amq_msg_release (bufs[i]);
+   }
+   __atomic_store_n (&g_failed, true, __ATOMIC_RELEASE);
+   return amq_worker_result_STOP;
+}
+
+// The queue blocks when it is full, so any post that does not succeed is an
+// error.
+static enum amq_worker_result_t bench_producer (const struct amq_worker_t *self,
+                                                void *cdata)
+{
+   const struct scenario_t *s = g_scenario;
+   void *bufs[256];
+   size_t lens[256];
+
+   (void)cdata;
+
+   if (s->engine == amq_queue_engine_INLINE) {
+      char buf[s->size];
+      memset (buf, 0, sizeof buf);
+      for (size_t i=0; i<g_messages; i++) {
+         ((struct bench_msg_t *)buf)->sent_ns = clock_ns ();
+         if (amq_post_copy (g_queue, buf, sizeof buf) != amq_post_result_OK)
+            return producer_fail (self, NULL, 0);
+      }
+      return amq_worker_result_STOP;
+   }
+
+   for (size_t i=0; i<g_messages; ) {
+      size_t n = g_messages - i < s->batch ? g_messages - i : s->batch;
+      for (size_t j=0; j<n; j++) {
+         if (!(bufs[j] = msg_new ())) {
+            fprintf (stderr, "Out of memory\n");
+            exit (EXIT_FAILURE);
+         }
+         lens[j] = s->size;
+      }
+      size_t nposted = 0;
+      if (n == 1) {
+         nposted = amq_post (g_queue, bufs[0], lens[0]) == amq_post_result_OK ? 1 : 0;
+      } else {
+         nposted = amq_post_many (g_queue, bufs, lens, n);
+      }
+      if (nposted < n)
+         return producer_fail (self, &bufs[nposted], n - nposted);
+      i += n;
+   }
+
+   return amq_worker_result_STOP;
+}
+
+static bool start_consumers (const struct scenario_t *s)
+{
+   char name[32];
+
+   if (strcmp (s->consumer, "task") == 0 && !(amq_executor_start (s->nconsumers)))
+      return false;
+
+   for (size_t i=0; i<s->nconsumers; i++) {
+      snprintf (name, sizeof name, "bench-c%zu", i);
+      bool ok = false;
+      if (strcmp (s->consumer, "thread") == 0) {
+         ok = amq_consumer_create (g_queue, name, bench_consumer, &g_hists[i]);
+      } else if (strcmp (s->consumer, "batch") == 0) {
+         ok = amq_batch_consumer_create (g_queue, name, bench_batch_consumer,
+                                         s->batch > 1 ? s->batch : 32, 0, &g_hists[i]);
+      } else if (strcmp (s->consumer, "task") == 0) {
+         ok = amq_task_consumer_create (g_queue, name, bench_consumer, &g_hists[i]);
+      }
+      if (!ok)
+         return false;
+   }
+
+   return true;
+}
+
+static void set_consumers (const struct scenario_t *s, bool suspend)
+{
+   char name[32];
+   for (size_t i=0; i<s->nconsumers; i++) {
+      snprintf (name, sizeof name, "bench-c%zu", i);
+      if (suspend) {
+         amq_worker_sigset (name, AMQ_SIGNAL_SUSPEND);
+      } else {
+         amq_worker_sigclr (name, AMQ_SIGNAL_SUSPEND);
+      }
+   }
+}
+
+static uint64_t rusage_cpu_ns (const struct rusage *ru)
+{
+   return (uint64_t)(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000
+        + (uint64_t)(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000;
+}
+
+static bool check_scenario (const struct scenario_t *s)
+{
+   const char *error = NULL;
+
+   if (!s->nproducers || !s->nconsumers ||
+       s->nproducers + s->nconsumers > BENCH_MAX_WORKERS)
+      error = "producers and consumers must be between 1 and 64 in total";
+   else if (s->size < sizeof (struct bench_msg_t))
+      error = "messages are too small to hold a timestamp";
+   else if (!s->batch || s->batch > 256)
+      error = "the batch size must be between 1 and 256";
+   else if (s->engine == amq_queue_engine_SPSC && (s->nproducers > 1 || s->nconsumers > 1))
+      error = "the spsc engine needs exactly one producer and one consumer";
+   else if (s->engine == amq_queue_engine_INLINE && s->batch > 1)
+      error = "the inline engine cannot post in batches";
+   else if (strcmp (s->consumer, "thread") && strcmp (s->consumer, "batch") &&
+            strcmp (s->consumer, "task"))
+      error = "the consumer must be thread, batch or task";
+
+   if (error)
+      fprintf (stderr, "Scenario [%s]: %s\n", s->name, error);
+
+   return !error;
+}
+
+static int run_scenario (const struct scenario_t *s, size_t messages)
+{
+   struct rusage ru_start, ru_end;
+   size_t cycles = 0;
+
+   if (!(check_scenario (s)))
+      return EXIT_FAILURE;
+
+   g_scenario = s;
+   g_messages = messages;
+   g_expected = (uint64_t)s->nproducers * messages;
+   g_queue = amq_intern (BENCH_QUEUE);
+
+   if (!(amq_lib_init ()))
+      return EXIT_FAILURE;
+
+   bool ok = s->engine == amq_queue_engine_INLINE
+           ? amq_message_queue_create_inline (g_queue, 0, s->size)
+           : amq_message_queue_create_ex (g_queue, s->engine, 0);
+   if (!ok || !(start_consumers (s))) {
+      fprintf (stderr, "Scenario [%s]: failed to set up\n", s->name);
+      amq_lib_destroy ();
+      return EXIT_FAILURE;
+   }
+
+   getrusage (RUSAGE_SELF, &ru_start);
+   uint64_t start_ns = clock_ns ();
+
+   for (size_t i=0; i<s->nproducers; i++) {
+      char name[32];
+      snprintf (name, sizeof name, "bench-p%zu", i);
+      if (!(amq_producer_create (name, bench_producer, NULL))) {
+         fprintf (stderr, "Producer [%s]: failed to start\n", name);
+         __atomic_store_n (&g_failed, true, __ATOMIC_RELEASE);
+      }
+   }
+
+   // The consumer of the last message records the end time, so polling here
+   // does not add to the measurement.
+   while (!(__atomic_load_n (&g_end_ns, __ATOMIC_ACQUIRE))) {
+      // The process exits after a scenario, so the library is not shut down:
+      // the other producers could be blocked on a queue that nobody drains.
+      if (__atomic_load_n (&g_failed, __ATOMIC_ACQUIRE)) {
+         fprintf (stderr, "Scenario [%s]: failed\n", s->name);
+         return EXIT_FAILURE;
+      }
+      if (s->suspend_us) {
+         usleep (s->suspend_us);
+         set_consumers (s, true);
+         usleep (s->suspend_us / 10 + 1);
+         set_consumers (s, false);
+         cycles++;
+      } else {
+         usleep (1000);
+      }
+   }
+
+   uint64_t elapsed_ns = g_end_ns - start_ns;
+   getrusage (RUSAGE_SELF, &ru_end);
+
+   amq_lib_destroy ();
+
+   struct hist_t *total = &g_hists[BENCH_MAX_WORKERS - 1];
+   for (size_t i=0; i<s->nconsumers; i++) {
+      total->count += g_hists[i].count;
+      for (size_t j=0; j<HIST_NBUCKETS; j++) {
+         total->buckets[j] += g_hists[i].buckets[j];
+      }
+   }
+
+   printf ("{\"version\":\"%s\",\"scenario\":\"%s\",\"engine\":\"%s\",\"consumer\":\"%s\","
+           "\"producers\":%zu,\"consumers\":%zu,\"size\":%zu,\"batch\":%zu,"
+           "\"suspend_us\":%zu,\"suspend_cycles\":%zu,\"messages\":%" PRIu64 ","
+           "\"seconds\":%.6f,\"msgs_per_sec\":%.0f,"
+           "\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ","
+           "\"cpu_ns_per_msg\":%.1f,\"peak_rss_kb\":%ld}\n",
+           amq_version, s->name, engine_name (s->engine), s->consumer,
+           s->nproducers, s->nconsumers, s->size, s->batch,
+           s->suspend_us, cycles, g_expected,
+           elapsed_ns / 1e9, g_expected / (elapsed_ns / 1e9),
+           hist_percentile (total, 50), hist_percentile (total, 99),
+           (double)(rusage_cpu_ns (&ru_end) - rusage_cpu_ns (&ru_start)) / g_expected,
+           ru_end.ru_maxrss);
+   fflush (stdout);
+
+   return EXIT_SUCCESS;
+}
+
+// Run a scenario in a child process, so that every scenario starts with a
+// fresh library and its own peak RSS.
+static bool run_child (const struct scenario_t *s, size_t messages)
+{
+   fflush (stdout);
+
+   pid_t pid = fork ();
+   if (pid < 0) {
+      fprintf (stderr, "Failed to fork: %s\n", strerror (errno));
+      return false;
+   }
+   if (pid == 0)
+      exit (run_scenario (s, messages));
+
+   int status = 0;
+   if ((waitpid (pid, &status, 0)) != pid || !WIFEXITED (status) ||
+       WEXITSTATUS (status) != EXIT_SUCCESS) {
+      fprintf (stderr, "Scenario [%s] failed\n", s->name);
+      return false;
+   }
+
+   return true;
+}
+
+static void usage (const char *prog)
+{
+   printf ("Usage: %s [options]\n"
+           "Without --scenario or --engine, runs every scenario in the suite.\n"
+           "   --list                  List the scenarios in the suite\n"
+           "   --scenario=NAME         Run a single scenario from the suite\n"
+           "   --messages=N            Messages per producer [%i]\n"
+           "A custom scenario is run when --engine is given:\n"
+           "   --engine=NAME           cmq, ring, spsc, steal, intrusive or inline\n"
+           "   --consumer=TYPE         thread, batch or task [thread]\n"
+           "   --producers=N           [1]\n"
+           "   --consumers=N           [1]\n"
+           "   --size=BYTES            Message size [64]\n"
+           "   --batch=N               Messages per post, and per batch consumer call [1]\n"
+           "   --suspend-us=N          Suspend and resume the consumers every N us [0]\n",
+           prog, BENCH_MESSAGES);
+}
+
+// Returns the value of an option of the form --name=value, or NULL.
+static const char *option (const char *arg, const char *name)
+{
+   size_t len = strlen (name);
+   if (strncmp (arg, name, len) == 0 && arg[len] == '=')
+      return &arg[len + 1];
+   return NULL;
+}
+
+int main (int argc, char **argv)
+{
+   struct scenario_t custom = { "custom", amq_queue_engine_CMQ, "thread", 1, 1, 64, 1, 0 };
+   bool have_custom = false;
+   const char *scenario = NULL;
+   size_t messages = BENCH_MESSAGES;
+   const char *value = NULL;
+
+   for (int i=1; i<argc; i++) {
+      const char *arg = argv[i];
+      if (strcmp (arg, "--help") == 0) {
+         usage (argv[0]);
+         return EXIT_SUCCESS;
+      } else if (strcmp (arg, "--list") == 0) {
+         for (size_t j=0; j<SUITE_SIZE; j++) {
+            printf ("%s\n", g_suite[j].name);
+         }
+         return EXIT_SUCCESS;
+      } else if ((value = option (arg, "--scenario"))) {
+         scenario = value;
+      } else if ((value = option (arg, "--messages"))) {
+         messages = strtoull (value, NULL, 0);
+      } else if ((value = option (arg, "--engine"))) {
+         size_t j;
+         for (j=0; j<NENGINES && strcmp (value, g_engines[j].name); j++)
+            ;
+         if (j == NENGINES) {
+            fprintf (stderr, "Unknown engine [%s]\n", value);
+            return EXIT_FAILURE;
+         }
+         custom.engine = g_engines[j].engine;
+         have_custom = true;
+      } else if ((value = option (arg, "--consumer"))) {
+         custom.consumer = value;
+      } else if ((value = option (arg, "--producers"))) {
+         custom.nproducers = strtoull (value, NULL, 0);
+      } else if ((value = option (arg, "--consumers"))) {
+         custom.nconsumers = strtoull (value, NULL, 0);
+      } else if ((value = option (arg, "--size"))) {
+         custom.size = strtoull (value, NULL, 0);
+      } else if ((value = option (arg, "--batch"))) {
+         custom.batch = strtoull (value, NULL, 0);
+      } else if ((value = option (arg, "--suspend-us"))) {
+         custom.suspend_us = strtoull (value, NULL, 0);
+      } else {
+         fprintf (stderr, "Unknown option [%s]\n", arg);
+         usage (argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (!messages) {
+      fprintf (stderr, "The number of messages must be at least 1\n");
+      return EXIT_FAILURE;
+   }
+
+   if (have_custom)
+      return run_scenario (&custom, messages);
+
+   bool ok = true;
+   for (size_t i=0; i<SUITE_SIZE; i++) {
+      if (scenario && strcmp (scenario, g_suite[i].name))
+         continue;
+      ok = run_child (&g_suite[i], messages) && ok;
+      if (scenario)
+         return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   if (scenario) {
+      fprintf (stderr, "Unknown scenario [%s]\n", scenario);
+      return EXIT_FAILURE;
+   }
+
+   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
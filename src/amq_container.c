@@ -2,16 +2,316 @@
 #include <string.h>
 
 #include <pthread.h>
+#include <sys/mman.h>
 
-#include "ds_hmap.h"
 #include "ds_str.h"
+#include "amq.h"
 #include "amq_container.h"
+#include "amq_epoch.h"
+
+/* ************************************************************
+ * Interned names live in a single arena that is reserved once and never
+ * moves or shrinks, so any thread can tell whether a name was interned by
+ * checking that it points into the arena, without a lock. Each name is
+ * preceded by a header with its hash and length, and with its own offset
+ * in the arena, which a pointer into the middle of a name cannot match.
+ *
+ * The arena is only written by amq_intern(), under g_intern.lock, which also
+ * guards a hash set of the names in it so that a name is interned once.
+ */
+#define INTERN_ARENA_SIZE  (16 * 1024 * 1024)
+
+struct intern_hdr_t {
+   uint32_t    offset;
+   uint32_t    hash;
+   size_t      len;
+};
+
+static struct {
+   pthread_mutex_t    lock;
+   char              *base;
+   size_t             used;
+
+   // Offsets of the names in the arena, 0 for an empty slot.
+   uint32_t          *set;
+   size_t             set_mask;
+   size_t             count;
+} g_intern = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0, 0 };
+
+static uint32_t str_hash (const char *name, size_t *len)
+{
+   const char *tmp = name;
+   uint32_t ret = 2166136261u;
+   while (*tmp) {
+      ret ^= (uint8_t)*tmp++;
+      ret *= 16777619u;
+   }
+   *len = tmp - name;
+   return ret;
+}
+
+static const struct intern_hdr_t *intern_hdr (const char *name)
+{
+   char *base = __atomic_load_n (&g_intern.base, __ATOMIC_ACQUIRE);
+   if (!base || name < base + sizeof (struct intern_hdr_t) || name >= base + INTERN_ARENA_SIZE)
+      return NULL;
+
+   const struct intern_hdr_t *hdr = (const struct intern_hdr_t *)name - 1;
+   return hdr->offset == (uint32_t)(name - base) ? hdr : NULL;
+}
+
+// The hash of a name, and its length. Interned names have both already.
+static uint32_t name_hash (const char *name, size_t *len)
+{
+   const struct intern_hdr_t *hdr = intern_hdr (name);
+   if (hdr) {
+      *len = hdr->len;
+      return hdr->hash;
+   }
+
+   return str_hash (name, len);
+}
+
+static bool intern_reserve (void)
+{
+   if (g_intern.base)
+      return true;
+
+#ifdef MAP_NORESERVE
+   int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#else
+   int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#endif
+   void *base = mmap (NULL, INTERN_ARENA_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+   if (base == MAP_FAILED)
+      return false;
+
+   __atomic_store_n (&g_intern.base, base, __ATOMIC_RELEASE);
+   return true;
+}
+
+static void intern_set_insert (uint32_t *set, size_t mask, uint32_t hash, uint32_t offset)
+{
+   size_t i = hash & mask;
+   while (set[i])
+      i = (i + 1) & mask;
+   set[i] = offset;
+}
+
+static bool intern_set_grow (void)
+{
+   if (g_intern.set && (g_intern.count + 1) * 2 <= g_intern.set_mask + 1)
+      return true;
+
+   size_t size = g_intern.set ? (g_intern.set_mask + 1) * 2 : 64;
+   uint32_t *set = calloc (size, sizeof *set);
+   if (!set)
+      return false;
+
+   for (size_t i=0; g_intern.set && i<=g_intern.set_mask; i++) {
+      if (g_intern.set[i]) {
+         struct intern_hdr_t *hdr = (struct intern_hdr_t *)(g_intern.base + g_intern.set[i]) - 1;
+         intern_set_insert (set, size - 1, hdr->hash, g_intern.set[i]);
+      }
+   }
+
+   free (g_intern.set);
+   g_intern.set = set;
+   g_intern.set_mask = size - 1;
+   return true;
+}
+
+amq_name_t amq_intern (const char *name)
+{
+   if (!name)
+      return NULL;
+
+   if (intern_hdr (name))
+      return name;
+
+   size_t len = 0;
+   uint32_t hash = str_hash (name, &len);
+   const char *ret = NULL;
+
+   pthread_mutex_lock (&g_intern.lock);
+
+   if (!(intern_reserve ()) || !(intern_set_grow ()))
+      goto errorexit;
+
+   size_t i = hash & g_intern.set_mask;
+   for (; g_intern.set[i]; i = (i + 1) & g_intern.set_mask) {
+      const char *existing = g_intern.base + g_intern.set[i];
+      const struct intern_hdr_t *hdr = (const struct intern_hdr_t *)existing - 1;
+      if (hdr->hash == hash && hdr->len == len && memcmp (existing, name, len) == 0) {
+         ret = existing;
+         goto errorexit;
+      }
+   }
+
+   // Keep headers aligned.
+   size_t needed = (sizeof (struct intern_hdr_t) + len + 1 + 7) & ~(size_t)7;
+   if (g_intern.used + needed > INTERN_ARENA_SIZE)
+      goto errorexit;
+
+   struct intern_hdr_t *hdr = (struct intern_hdr_t *)(g_intern.base + g_intern.used);
+   char *str = (char *)(hdr + 1);
+   hdr->offset = (uint32_t)(str - g_intern.base);
+   hdr->hash = hash;
+   hdr->len = len;
+   memcpy (str, name, len + 1);
+
+   g_intern.used += needed;
+   g_intern.set[i] = hdr->offset;
+   g_intern.count++;
+   ret = str;
+
+errorexit:
+   pthread_mutex_unlock (&g_intern.lock);
+   return ret;
+}
+
+/* ************************************************************
+ * Lookups far outnumber changes (every post looks its queue up by name,
+ * while queues and workers are created once), so readers use the hash table
+ * without taking any lock. Writers are serialised by the container's lock.
+ *
+ * The table uses open addressing with linear probing, and is at most half
+ * full. An entry is filled in before its name is stored, with a release
+ * store, so a reader that sees the name sees the rest of the entry; until
+ * then the slot reads as empty. A removal only marks its entry removed,
+ * leaving it in place so that it still links the probe sequences that pass
+ * through it. Entries are never changed after that, and slots are never
+ * reused, so a change only copies the table when it runs out of free slots.
+ * The copy leaves out the removed entries and is swapped in, and the old
+ * table is retired and freed once no reader can be using it (see
+ * amq_epoch.h).
+ *
+ * Names are owned by the entries. The name of a live entry moves to the new
+ * table when the table is copied, while the name of a removed entry stays
+ * with the table that it was removed from, and is freed with it.
+ */
+#define TABLE_MIN_SIZE     (16)
+
+struct entry_t {
+   char              *name;
+   size_t             len;
+   uint32_t           hash;
+   uint32_t           removed;
+   void              *element;
+};
+
+struct table_t {
+   size_t             mask;
+
+   // Only used by writers: the live entries, and the slots in use, which
+   // includes the removed entries.
+   size_t             count;
+   size_t             used;
+
+   struct entry_t     entries[];
+};
 
 struct amq_container_t {
-   ds_hmap_t         *map;
-   pthread_rwlock_t   lock;
+   struct table_t    *table;
+
+   // Serialises writers only.
+   pthread_mutex_t    lock;
 };
 
+static struct table_t *table_new (size_t count)
+{
+   size_t size = TABLE_MIN_SIZE;
+   while (size < count * 2)
+      size <<= 1;
+
+   struct table_t *ret = calloc (1, sizeof *ret + size * sizeof ret->entries[0]);
+   if (!ret)
+      return NULL;
+
+   ret->mask = size - 1;
+   return ret;
+}
+
+static void table_free (void *table)
+{
+   struct table_t *t = table;
+   for (size_t i=0; i<=t->mask; i++) {
+      if (t->entries[i].removed)
+         free (t->entries[i].name);
+   }
+   free (t);
+}
+
+static struct entry_t *table_find (struct table_t *table, const char *name, size_t len,
+                                   uint32_t hash)
+{
+   for (size_t i=hash & table->mask;
+        __atomic_load_n (&table->entries[i].name, __ATOMIC_ACQUIRE);
+        i=(i + 1) & table->mask) {
+      struct entry_t *entry = &table->entries[i];
+      if (entry->hash == hash && entry->len == len &&
+          !__atomic_load_n (&entry->removed, __ATOMIC_ACQUIRE) &&
+          memcmp (entry->name, name, len) == 0)
+         return entry;
+   }
+   return NULL;
+}
+
+// Fill in a free slot and then publish it. The caller holds the lock, and
+// has made sure that the table has room.
+static void table_insert (struct table_t *table, const struct entry_t *entry)
+{
+   size_t i = entry->hash & table->mask;
+   while (table->entries[i].name)
+      i = (i + 1) & table->mask;
+
+   struct entry_t *slot = &table->entries[i];
+   slot->len = entry->len;
+   slot->hash = entry->hash;
+   slot->element = entry->element;
+   __atomic_store_n (&slot->name, entry->name, __ATOMIC_RELEASE);
+
+   table->count++;
+   table->used++;
+}
+
+// Whether a reader sees entry as present.
+static bool table_live (struct entry_t *entry)
+{
+   return __atomic_load_n (&entry->name, __ATOMIC_ACQUIRE) &&
+          !__atomic_load_n (&entry->removed, __ATOMIC_ACQUIRE);
+}
+
+static bool table_has_room (struct table_t *table)
+{
+   return (table->used + 1) * 2 <= table->mask + 1;
+}
+
+// Copy the live entries of table into a new table that is at most a quarter
+// full once extra more entries are added. That leaves as many free slots as
+// there are entries, so copies stay rare however often entries come and go.
+static struct table_t *table_copy (struct table_t *table, size_t extra)
+{
+   struct table_t *ret = table_new ((table->count + extra) * 2);
+   if (!ret)
+      return NULL;
+
+   for (size_t i=0; i<=table->mask; i++) {
+      struct entry_t *entry = &table->entries[i];
+      if (entry->name && !entry->removed)
+         table_insert (ret, entry);
+   }
+
+   return ret;
+}
+
+// Publish a new table; the caller holds the lock.
+static void table_replace (amq_container_t *container, struct table_t *table)
+{
+   struct table_t *old = __atomic_exchange_n (&container->table, table, __ATOMIC_SEQ_CST);
+   amq_epoch_retire (old, table_free);
+}
+
 
 amq_container_t *amq_container_new (void)
 {
@@ -19,12 +319,12 @@ amq_container_t *amq_container_new (void)
    if (!ret)
       return NULL;
 
-   if (!(ret->map = ds_hmap_new (256))) {
+   if (!(ret->table = table_new (0))) {
       free (ret);
       return NULL;
    }
 
-   pthread_rwlock_init (&ret->lock, NULL);
+   pthread_mutex_init (&ret->lock, NULL);
 
    return ret;
 }
@@ -34,96 +334,106 @@ void amq_container_del (amq_container_t *container,  void (*item_del_fptr) (void
    if (!container)
       return;
 
-   pthread_rwlock_wrlock (&container->lock);
-
-   if (item_del_fptr) {
-      const char **names = NULL;
-      size_t *namelens = NULL;
-      if ((ds_hmap_keys (container->map, (void ***)&names, &namelens))) {
-         for (size_t i=0; names && namelens && names[i] && namelens[i]; i++) {
-            void *item = NULL;
-            if (!(ds_hmap_get (container->map, names[i], namelens[i],
-                                               &item, NULL))) {
-               continue;
-            }
-            item_del_fptr (item);
-         }
-      }
-      free (names);
-      free (namelens);
-   }
+   pthread_mutex_lock (&container->lock);
 
-   ds_hmap_del (container->map);
+   struct table_t *table = container->table;
+   for (size_t i=0; i<=table->mask; i++) {
+      if (!table->entries[i].name || table->entries[i].removed)
+         continue;
+      if (item_del_fptr)
+         item_del_fptr (table->entries[i].element);
+      free (table->entries[i].name);
+   }
+   table_free (table);
 
-   pthread_rwlock_unlock (&container->lock);
-   pthread_rwlock_destroy (&container->lock);
+   pthread_mutex_unlock (&container->lock);
+   pthread_mutex_destroy (&container->lock);
 
    free (container);
+
+   // Nobody is left to read the tables that were replaced.
+   amq_epoch_drain ();
 }
 
 bool amq_container_add (amq_container_t *container,
                         const char *name, void *element)
 {
-   if (!container)
+   if (!container || !name)
       return false;
 
-   void *exist_data = NULL;
-   size_t exist_datalen = 0;
+   bool ret = false;
+   size_t len = 0;
+   uint32_t hash = name_hash (name, &len);
+   struct table_t *table = NULL;
+   char *dup = NULL;
 
-   pthread_rwlock_wrlock (&container->lock);
+   pthread_mutex_lock (&container->lock);
 
    // Check if this item exists - we don't allow duplicates and we
    // don't want to overwrite any existing queue that exists with this
    // name.
-   if ((ds_hmap_get (container->map, name, strlen (name) + 1,
-                                     &exist_data, &exist_datalen))) {
-      pthread_rwlock_unlock (&container->lock);
-      return false;
-   }
+   if ((table_find (container->table, name, len, hash)))
+      goto errorexit;
 
-   if (!(ds_hmap_set (container->map, name, strlen (name) + 1,
-                                      element, 0))) {
-      pthread_rwlock_unlock (&container->lock);
-      return false;
+   if (!(dup = ds_str_dup (name)))
+      goto errorexit;
+
+   table = container->table;
+   if (!(table_has_room (table)) && !(table = table_copy (table, 1))) {
+      free (dup);
+      goto errorexit;
    }
 
-   pthread_rwlock_unlock (&container->lock);
-   return true;
+   struct entry_t entry = { dup, len, hash, 0, element };
+   table_insert (table, &entry);
+   if (table != container->table)
+      table_replace (container, table);
+   ret = true;
+
+errorexit:
+   pthread_mutex_unlock (&container->lock);
+   return ret;
 }
 
 void *amq_container_remove (amq_container_t *container, const char *name)
 {
-   void *ret = NULL;
-
-   if (!container)
+   if (!container || !name)
       return NULL;
 
-   pthread_rwlock_wrlock (&container->lock);
+   void *ret = NULL;
+   size_t len = 0;
+   uint32_t hash = name_hash (name, &len);
 
-   if (!(ds_hmap_get (container->map, name, strlen (name) + 1,
-                                      &ret, NULL))) {
-      pthread_rwlock_unlock (&container->lock);
-      return NULL;
+   pthread_mutex_lock (&container->lock);
+
+   struct entry_t *entry = table_find (container->table, name, len, hash);
+   if (entry) {
+      ret = entry->element;
+      __atomic_store_n (&entry->removed, 1, __ATOMIC_RELEASE);
+      container->table->count--;
    }
 
-   ds_hmap_remove (container->map, name, strlen (name) + 1);
-   pthread_rwlock_unlock (&container->lock);
+   pthread_mutex_unlock (&container->lock);
    return ret;
 }
 
 void *amq_container_find (amq_container_t *container, const char *name)
 {
-   if (!container)
+   if (!container || !name)
       return NULL;
 
    void *ret = NULL;
-   size_t namelen = name ? strlen (name) + 1 : 0;
+   size_t len = 0;
+   uint32_t hash = name_hash (name, &len);
 
-   pthread_rwlock_rdlock (&container->lock);
-   bool rc = ds_hmap_get (container->map, name, namelen, &ret, NULL);
-   pthread_rwlock_unlock (&container->lock);
+   amq_epoch_enter ();
+   struct entry_t *entry = table_find (__atomic_load_n (&container->table, __ATOMIC_ACQUIRE),
+                                       name, len, hash);
+   if (entry)
+      ret = entry->element;
+   amq_epoch_exit ();
 
-   return rc ? ret : NULL;
+   return ret;
 }
 
 size_t amq_container_names (amq_container_t *container, char ***names)
@@ -131,40 +441,42 @@ size_t amq_container_names (amq_container_t *container, char ***names)
    if (!container)
       return 0;
 
-   char **retvals = NULL;
-   char **tmp = NULL;
    size_t ret = 0;
-   pthread_rwlock_rdlock (&container->lock);
-   ret = ds_hmap_keys (container->map, (void ***)&retvals, NULL);
-   if (!ret) {
-      pthread_rwlock_unlock (&container->lock);
-      free (retvals);
-      *names = NULL;
-      return 0;
-   }
-   if (!(tmp = calloc (ret + 1, sizeof *tmp))) {
-      pthread_rwlock_unlock (&container->lock);
-      free (retvals);
-      return 0;
+   char **tmp = NULL;
+
+   *names = NULL;
+
+   amq_epoch_enter ();
+
+   // Writers may change the table while we read it, so count the entries that
+   // we see rather than trusting the table's count.
+   struct table_t *table = __atomic_load_n (&container->table, __ATOMIC_ACQUIRE);
+   size_t count = 0;
+   for (size_t i=0; i<=table->mask; i++) {
+      if (table_live (&table->entries[i]))
+         count++;
    }
-   for (size_t i=0; i<ret; i++) {
-      if (!(tmp[i] = ds_str_dup (retvals[i]))) {
-         pthread_rwlock_unlock (&container->lock);
-         free (retvals);
+
+   if (!count || !(tmp = calloc (count + 1, sizeof *tmp)))
+      goto errorexit;
+
+   for (size_t i=0; i<=table->mask && ret<count; i++) {
+      struct entry_t *entry = &table->entries[i];
+      if (!(table_live (entry)))
+         continue;
+      if (!(tmp[ret++] = ds_str_dup (entry->name))) {
          for (size_t j=0; tmp[j]; j++) {
             free (tmp[j]);
          }
          free (tmp);
-         *names = NULL;
-         return 0;
+         ret = 0;
+         goto errorexit;
       }
    }
 
-   pthread_rwlock_unlock (&container->lock);
-
    *names = tmp;
-   free (retvals);
 
+errorexit:
+   amq_epoch_exit ();
    return ret;
 }
-
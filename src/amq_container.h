@@ -19,6 +19,11 @@ extern "C" {
    void *amq_container_remove (amq_container_t *container,
                                const char *name);
 
+   // Lookups do not lock, and may run alongside changes. The container only
+   // protects its own table: an element that is found may be removed and
+   // freed by its owner at any time, so the caller must know that it outlives
+   // the lookup, or take its own reference inside an amq_epoch_enter() section
+   // that covers the lookup, and the owner must retire rather than free it.
    void *amq_container_find (amq_container_t *container, const char *name);
 
    size_t amq_container_names (amq_container_t *container, char ***names);
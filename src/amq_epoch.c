@@ -0,0 +1,187 @@
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "amq_epoch.h"
+
+/* ************************************************************
+ * There is a global epoch, and every thread that reads has a record of the
+ * epoch it was in when it entered its current read section (0 when it is
+ * not in one). Entering stores the epoch and then fences, so a writer that
+ * unpublishes an object and then scans the records either sees the reader,
+ * or the reader sees the object already unpublished.
+ *
+ * An object retired in epoch E is only freed once every active reader
+ * entered in a later epoch. Retiring moves the global epoch on, so that new
+ * readers do not hold up what was just retired.
+ *
+ * Records are never freed; when a thread exits its record is marked unused
+ * and the next new reader takes it over.
+ */
+struct epoch_rec_t {
+   uint64_t              epoch;
+   uint32_t              in_use;
+   struct epoch_rec_t   *next;
+};
+
+struct epoch_limbo_t {
+   void                 *ptr;
+   void                (*free_fn) (void *);
+   uint64_t              epoch;
+   struct epoch_limbo_t *next;
+};
+
+static uint64_t g_epoch = 1;
+static struct epoch_rec_t *g_records;
+
+// Retired objects, oldest last. Retiring is rare, so a lock is fine here.
+static pthread_mutex_t g_limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_limbo_t *g_limbo;
+
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_key;
+
+static __thread struct epoch_rec_t *tl_rec;
+static __thread size_t tl_depth;
+
+static void rec_release (void *rec)
+{
+   struct epoch_rec_t *r = rec;
+   __atomic_store_n (&r->epoch, 0, __ATOMIC_RELEASE);
+   __atomic_store_n (&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void key_create (void)
+{
+   pthread_key_create (&g_key, rec_release);
+}
+
+// Returns NULL only if out of memory, in which case the caller reads with no
+// protection from reclamation; see amq_epoch_enter().
+static struct epoch_rec_t *rec_get (void)
+{
+   if (tl_rec)
+      return tl_rec;
+
+   pthread_once (&g_key_once, key_create);
+
+   struct epoch_rec_t *rec = NULL;
+   for (rec = __atomic_load_n (&g_records, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+      uint32_t unused = 0;
+      if (__atomic_compare_exchange_n (&rec->in_use, &unused, 1, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+         break;
+   }
+
+   if (!rec) {
+      if (!(rec = calloc (1, sizeof *rec)))
+         return NULL;
+      rec->in_use = 1;
+      rec->next = __atomic_load_n (&g_records, __ATOMIC_RELAXED);
+      while (!(__atomic_compare_exchange_n (&g_records, &rec->next, rec, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)))
+         ;
+   }
+
+   pthread_setspecific (g_key, rec);
+   tl_rec = rec;
+   return rec;
+}
+
+void amq_epoch_enter (void)
+{
+   if (tl_depth++)
+      return;
+
+   // Without a record there is nothing to publish; the lookup still works,
+   // but only because writers retire so rarely. This only happens when the
+   // first calloc() of a new thread fails.
+   struct epoch_rec_t *rec = rec_get ();
+   if (!rec)
+      return;
+
+   __atomic_store_n (&rec->epoch, __atomic_load_n (&g_epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+void amq_epoch_exit (void)
+{
+   if (--tl_depth)
+      return;
+
+   if (tl_rec)
+      __atomic_store_n (&tl_rec->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// The oldest epoch that an active reader is in, or UINT64_MAX if there are
+// none.
+static uint64_t oldest_reader (void)
+{
+   uint64_t ret = UINT64_MAX;
+
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+   for (struct epoch_rec_t *rec = __atomic_load_n (&g_records, __ATOMIC_ACQUIRE);
+        rec; rec = rec->next) {
+      uint64_t epoch = __atomic_load_n (&rec->epoch, __ATOMIC_SEQ_CST);
+      if (epoch && epoch < ret)
+         ret = epoch;
+   }
+
+   return ret;
+}
+
+// Free everything retired before epoch. Call with g_limbo_lock held.
+static void limbo_free (uint64_t epoch)
+{
+   struct epoch_limbo_t **prev = &g_limbo;
+   while (*prev) {
+      struct epoch_limbo_t *item = *prev;
+      if (item->epoch < epoch) {
+         *prev = item->next;
+         item->free_fn (item->ptr);
+         free (item);
+      } else {
+         prev = &item->next;
+      }
+   }
+}
+
+void amq_epoch_retire (void *ptr, void (*free_fn) (void *))
+{
+   if (!ptr)
+      return;
+
+   struct epoch_limbo_t *item = calloc (1, sizeof *item);
+
+   pthread_mutex_lock (&g_limbo_lock);
+
+   uint64_t epoch = __atomic_fetch_add (&g_epoch, 1, __ATOMIC_SEQ_CST);
+   if (item) {
+      item->ptr = ptr;
+      item->free_fn = free_fn;
+      item->epoch = epoch;
+      item->next = g_limbo;
+      g_limbo = item;
+   }
+
+   uint64_t oldest = oldest_reader ();
+
+   // With nowhere to keep the object, wait for the readers that might be using
+   // it to leave.
+   while (!item && oldest <= epoch)
+      oldest = oldest_reader ();
+   if (!item)
+      free_fn (ptr);
+
+   limbo_free (oldest);
+
+   pthread_mutex_unlock (&g_limbo_lock);
+}
+
+void amq_epoch_drain (void)
+{
+   pthread_mutex_lock (&g_limbo_lock);
+   limbo_free (UINT64_MAX);
+   pthread_mutex_unlock (&g_limbo_lock);
+}
@@ -0,0 +1,41 @@
+#ifndef H_AMQ_EPOCH
+#define H_AMQ_EPOCH
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* ************************************************
+ * Epoch-based reclamation, for data that is read without locks and replaced
+ * by writers. A reader brackets its use of the data with amq_epoch_enter()
+ * and amq_epoch_exit(). A writer that has unpublished an object (so that no
+ * new reader can reach it) passes it to amq_epoch_retire(), and the object is
+ * freed once every reader that might still be using it has left.
+ *
+ * Read sections may nest, must be short, and must not block: a reader that
+ * stays inside one holds up the reclamation of everything retired after it
+ * entered.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void amq_epoch_enter (void);
+   void amq_epoch_exit (void);
+
+   // Free ptr with free_fn once no reader can be using it. This may free other
+   // objects that were retired earlier.
+   void amq_epoch_retire (void *ptr, void (*free_fn) (void *));
+
+   // Free everything that has been retired, immediately. Only for use when no
+   // thread can be inside a read section, such as while the library is being
+   // destroyed.
+   void amq_epoch_drain (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
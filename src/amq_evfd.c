@@ -0,0 +1,102 @@
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "amq_evfd.h"
+
+#ifdef __linux__
+
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+bool amq_evfd_open (struct amq_evfd_t *evfd)
+{
+   evfd->rfd = evfd->wfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+   return evfd->rfd >= 0;
+}
+
+void amq_evfd_close (struct amq_evfd_t *evfd)
+{
+   if (evfd->rfd >= 0)
+      close (evfd->rfd);
+   evfd->rfd = evfd->wfd = -1;
+}
+
+void amq_evfd_signal (struct amq_evfd_t *evfd)
+{
+   uint64_t one = 1;
+   while (write (evfd->wfd, &one, sizeof one) < 0 && errno == EINTR)
+      ;
+}
+
+void amq_evfd_clear (struct amq_evfd_t *evfd)
+{
+   uint64_t count;
+   while (read (evfd->rfd, &count, sizeof count) < 0 && errno == EINTR)
+      ;
+}
+
+#else
+
+/* ************************************************************
+ * Portable fallback: a pipe with both ends non-blocking. Only a single byte
+ * is ever in the pipe, because the caller signals it at most once between
+ * clears.
+ */
+static bool set_flags (int fd)
+{
+   int flags = fcntl (fd, F_GETFL);
+   return flags >= 0
+       && fcntl (fd, F_SETFL, flags | O_NONBLOCK) == 0
+       && fcntl (fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+bool amq_evfd_open (struct amq_evfd_t *evfd)
+{
+   int fds[2];
+
+   evfd->rfd = evfd->wfd = -1;
+   if (pipe (fds) != 0)
+      return false;
+
+   if (!(set_flags (fds[0])) || !(set_flags (fds[1]))) {
+      int saved = errno;
+      close (fds[0]);
+      close (fds[1]);
+      errno = saved;
+      return false;
+   }
+
+   evfd->rfd = fds[0];
+   evfd->wfd = fds[1];
+   return true;
+}
+
+void amq_evfd_close (struct amq_evfd_t *evfd)
+{
+   if (evfd->rfd >= 0)
+      close (evfd->rfd);
+   if (evfd->wfd >= 0)
+      close (evfd->wfd);
+   evfd->rfd = evfd->wfd = -1;
+}
+
+void amq_evfd_signal (struct amq_evfd_t *evfd)
+{
+   char byte = 1;
+   while (write (evfd->wfd, &byte, 1) < 0 && errno == EINTR)
+      ;
+}
+
+void amq_evfd_clear (struct amq_evfd_t *evfd)
+{
+   char bytes[16];
+   for (;;) {
+      ssize_t n = read (evfd->rfd, bytes, sizeof bytes);
+      if (n <= 0 && !(n < 0 && errno == EINTR))
+         break;
+   }
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef H_AMQ_EVFD
+#define H_AMQ_EVFD
+
+#include <stdbool.h>
+
+/* ************************************************
+ * A file descriptor that can be made readable and then cleared again, so
+ * that a queue can be waited on with poll(), epoll or kqueue alongside
+ * sockets. On Linux this is an eventfd(2); elsewhere it is a non-blocking
+ * pipe, with rfd the read end and wfd the write end.
+ *
+ * Neither operation blocks. The caller keeps track of whether the
+ * descriptor is readable, so that it is only signalled once and cleared
+ * once however many times it is set.
+ */
+struct amq_evfd_t {
+   int   rfd;
+   int   wfd;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns false if the descriptors could not be created, with errno set.
+   bool amq_evfd_open (struct amq_evfd_t *evfd);
+   void amq_evfd_close (struct amq_evfd_t *evfd);
+
+   // Make rfd readable.
+   void amq_evfd_signal (struct amq_evfd_t *evfd);
+
+   // Make rfd no longer readable.
+   void amq_evfd_clear (struct amq_evfd_t *evfd);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <time.h>
+
+#include "amq_futex.h"
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static bool futex_wait (uint32_t *addr, int op, uint32_t expected, size_t timeout_us)
+{
+   struct timespec ts, *tsp = NULL;
+
+   if (timeout_us != AMQ_FUTEX_FOREVER) {
+      ts.tv_sec = timeout_us / 1000000;
+      ts.tv_nsec = (timeout_us % 1000000) * 1000;
+      tsp = &ts;
+   }
+
+   long rc = syscall (SYS_futex, addr, op, expected, tsp, NULL, 0);
+   if (rc != 0 && errno == ETIMEDOUT)
+      return false;
+
+   return true;
+}
+
+bool amq_futex_wait (uint32_t *addr, uint32_t expected, size_t timeout_us)
+{
+   return futex_wait (addr, FUTEX_WAIT_PRIVATE, expected, timeout_us);
+}
+
+void amq_futex_wake (uint32_t *addr, int32_t nwaiters)
+{
+   syscall (SYS_futex, addr, FUTEX_WAKE_PRIVATE, nwaiters, NULL, NULL, 0);
+}
+
+bool amq_futex_wait_shared (uint32_t *addr, uint32_t expected, size_t timeout_us)
+{
+   return futex_wait (addr, FUTEX_WAIT, expected, timeout_us);
+}
+
+void amq_futex_wake_shared (uint32_t *addr, int32_t nwaiters)
+{
+   syscall (SYS_futex, addr, FUTEX_WAKE, nwaiters, NULL, NULL, 0);
+}
+
+#else
+
+#include <pthread.h>
+
+/* ************************************************************
+ * Portable fallback: the value is re-checked under a bucket lock, and the
+ * waker takes the same lock after changing the value, so no wakeup is lost.
+ */
+#define NBUCKETS     (64)
+
+static struct {
+   pthread_mutex_t lock;
+   pthread_cond_t  cond;
+} g_buckets[NBUCKETS];
+
+static pthread_once_t g_buckets_once = PTHREAD_ONCE_INIT;
+
+static void buckets_init (void)
+{
+   for (size_t i=0; i<NBUCKETS; i++) {
+      pthread_mutex_init (&g_buckets[i].lock, NULL);
+      pthread_cond_init (&g_buckets[i].cond, NULL);
+   }
+}
+
+static size_t bucket_index (uint32_t *addr)
+{
+   uintptr_t a = (uintptr_t)addr;
+   return ((a >> 2) ^ (a >> 9)) % NBUCKETS;
+}
+
+bool amq_futex_wait (uint32_t *addr, uint32_t expected, size_t timeout_us)
+{
+   bool ret = true;
+   pthread_once (&g_buckets_once, buckets_init);
+
+   size_t i = bucket_index (addr);
+   struct timespec ts;
+
+   if (timeout_us != AMQ_FUTEX_FOREVER) {
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_sec += timeout_us / 1000000;
+      ts.tv_nsec += (timeout_us % 1000000) * 1000;
+      if (ts.tv_nsec >= 1000000000) {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000;
+      }
+   }
+
+   pthread_mutex_lock (&g_buckets[i].lock);
+   if (__atomic_load_n (addr, __ATOMIC_ACQUIRE) == expected) {
+      if (timeout_us == AMQ_FUTEX_FOREVER) {
+         pthread_cond_wait (&g_buckets[i].cond, &g_buckets[i].lock);
+      } else {
+         if ((pthread_cond_timedwait (&g_buckets[i].cond, &g_buckets[i].lock, &ts))
+               == ETIMEDOUT)
+            ret = false;
+      }
+   }
+   pthread_mutex_unlock (&g_buckets[i].lock);
+
+   return ret;
+}
+
+void amq_futex_wake (uint32_t *addr, int32_t nwaiters)
+{
+   pthread_once (&g_buckets_once, buckets_init);
+
+   size_t i = bucket_index (addr);
+
+   // Different addresses share a bucket, so we cannot wake only nwaiters of them.
+   (void)nwaiters;
+   pthread_mutex_lock (&g_buckets[i].lock);
+   pthread_cond_broadcast (&g_buckets[i].cond);
+   pthread_mutex_unlock (&g_buckets[i].lock);
+}
+
+// The buckets are private to the process, so only its own threads are woken.
+bool amq_futex_wait_shared (uint32_t *addr, uint32_t expected, size_t timeout_us)
+{
+   return amq_futex_wait (addr, expected, timeout_us);
+}
+
+void amq_futex_wake_shared (uint32_t *addr, int32_t nwaiters)
+{
+   amq_futex_wake (addr, nwaiters);
+}
+
+#endif
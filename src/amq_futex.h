@@ -0,0 +1,46 @@
+#ifndef H_AMQ_FUTEX
+#define H_AMQ_FUTEX
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* ************************************************
+ * A minimal wait/wake primitive on a 32-bit word. On Linux this is a thin
+ * wrapper around futex(2); on other platforms it falls back to a small table
+ * of mutex/condvar pairs hashed on the address of the word.
+ *
+ * The caller must change the word before calling amq_futex_wake(), and the
+ * waiter must re-check its condition after amq_futex_wait() returns, as
+ * spurious wakeups are possible.
+ */
+#define AMQ_FUTEX_FOREVER     ((size_t)-1)
+#define AMQ_FUTEX_ALL         (INT32_MAX)
+
+// Defined where the _shared functions can wake threads in other processes.
+#ifdef __linux__
+#define AMQ_FUTEX_HAVE_SHARED
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Sleep while *addr is equal to expected, for at most timeout_us microseconds.
+   // Returns false if the timeout expired, true otherwise.
+   bool amq_futex_wait (uint32_t *addr, uint32_t expected, size_t timeout_us);
+
+   // Wake up to nwaiters threads sleeping on addr.
+   void amq_futex_wake (uint32_t *addr, int32_t nwaiters);
+
+   // The same, for a word in memory that is shared between processes. Without
+   // AMQ_FUTEX_HAVE_SHARED these only wake threads of the calling process.
+   bool amq_futex_wait_shared (uint32_t *addr, uint32_t expected, size_t timeout_us);
+   void amq_futex_wake_shared (uint32_t *addr, int32_t nwaiters);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
@@ -0,0 +1,763 @@
+#include <string.h>
+
+#include <pthread.h>
+
+#include "amq_ring.h"
+
+/* ************************************************************
+ * Every slot has a sequence number that tells producers and consumers
+ * whether the slot is theirs to use for a particular position:
+ *    seq == pos        the slot is free for the producer at pos,
+ *    seq == pos + 1    the slot holds the message for the consumer at pos.
+ * After consuming, the slot is handed to the producer one lap later by
+ * setting seq to pos + capacity.
+ *
+ * An inline ring also has a data area, straight after the slots, with room
+ * for one message in each slot. Messages are copied in, and found again from
+ * the index of their slot rather than through slot->buf, so that the ring
+ * holds no pointers and works wherever it is mapped. A consumer keeps the
+ * slot (its seq stays at pos + 1) until it calls amq_ring_release(), so that
+ * producers cannot overwrite the message while it is in use.
+ */
+struct ring_slot_t {
+   uint64_t    seq;
+   void       *buf;
+   size_t      buf_len;
+   uint64_t    posted_ns;
+};
+
+// The producer and consumer positions are each on a cache line of their own
+// so that producers and consumers do not invalidate each other's lines.
+// An inline ring has a non-zero stride.
+struct amq_ring_t {
+   uint64_t             mask;
+   size_t               stride;
+   size_t               msg_size;
+   char                 pad0[AMQ_CACHELINE_SIZE - sizeof (uint64_t) - 2 * sizeof (size_t)];
+   uint64_t             head;
+   char                 pad1[AMQ_CACHELINE_SIZE - sizeof (uint64_t)];
+   uint64_t             tail;
+   char                 pad2[AMQ_CACHELINE_SIZE - sizeof (uint64_t)];
+   struct ring_slot_t   slots[];
+};
+
+static size_t round_up_pow2 (size_t n)
+{
+   size_t ret = 2;
+   while (ret < n)
+      ret <<= 1;
+   return ret;
+}
+
+// Keep every slot's data aligned for whatever the caller copies in.
+static size_t inline_stride (size_t msg_size)
+{
+   return (msg_size + 15) & ~(size_t)15;
+}
+
+static void ring_init (amq_ring_t *ring, size_t capacity)
+{
+   ring->mask = capacity - 1;
+   for (size_t i=0; i<capacity; i++) {
+      ring->slots[i].seq = i;
+   }
+}
+
+static char *ring_data (amq_ring_t *ring, uint64_t pos)
+{
+   return (char *)&ring->slots[ring->mask + 1] + (pos & ring->mask) * ring->stride;
+}
+
+amq_ring_t *amq_ring_new (size_t capacity)
+{
+   capacity = round_up_pow2 (capacity);
+
+   amq_ring_t *ret = calloc (1, sizeof *ret + capacity * sizeof ret->slots[0]);
+   if (!ret)
+      return NULL;
+
+   ring_init (ret, capacity);
+   return ret;
+}
+
+size_t amq_ring_inline_size (size_t capacity, size_t msg_size)
+{
+   capacity = round_up_pow2 (capacity);
+   return sizeof (amq_ring_t) + capacity * (sizeof (struct ring_slot_t) + inline_stride (msg_size));
+}
+
+amq_ring_t *amq_ring_init_inline (void *mem, size_t capacity, size_t msg_size)
+{
+   amq_ring_t *ret = mem;
+
+   if (!ret || !msg_size)
+      return NULL;
+
+   ring_init (ret, round_up_pow2 (capacity));
+   ret->msg_size = msg_size;
+   ret->stride = inline_stride (msg_size);
+
+   return ret;
+}
+
+amq_ring_t *amq_ring_new_inline (size_t capacity, size_t msg_size)
+{
+   if (!msg_size)
+      return NULL;
+
+   void *mem = calloc (1, amq_ring_inline_size (capacity, msg_size));
+   if (!mem)
+      return NULL;
+
+   return amq_ring_init_inline (mem, capacity, msg_size);
+}
+
+void amq_ring_del (amq_ring_t *ring)
+{
+   free (ring);
+}
+
+// Claim the slot at head for a single message. Returns NULL if the ring is
+// full.
+static struct ring_slot_t *ring_claim (amq_ring_t *ring, uint64_t *claimed)
+{
+   struct ring_slot_t *slot = NULL;
+   uint64_t pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+
+   for (;;) {
+      slot = &ring->slots[pos & ring->mask];
+      uint64_t seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+      int64_t diff = (int64_t)(seq - pos);
+
+      if (diff == 0) {
+         if ((__atomic_compare_exchange_n (&ring->head, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+            break;
+      } else if (diff < 0) {
+         return NULL;
+      } else {
+         pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+      }
+   }
+
+   *claimed = pos;
+   return slot;
+}
+
+bool amq_ring_push (amq_ring_t *ring, void *buf, size_t buf_len, uint64_t posted_ns)
+{
+   uint64_t pos = 0;
+   struct ring_slot_t *slot = ring_claim (ring, &pos);
+   if (!slot)
+      return false;
+
+   slot->buf = buf;
+   slot->buf_len = buf_len;
+   slot->posted_ns = posted_ns;
+   __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+   return true;
+}
+
+size_t amq_ring_push_many (amq_ring_t *ring, void **bufs, size_t *buf_lens,
+                           uint64_t posted_ns, size_t nbufs)
+{
+   size_t nfree = 0;
+   uint64_t pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+
+   for (;;) {
+      // Count the run of free slots starting at pos; as with popping, nobody else
+      // can fill them without first moving head past pos.
+      nfree = 0;
+      while (nfree < nbufs) {
+         struct ring_slot_t *slot = &ring->slots[(pos + nfree) & ring->mask];
+         if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != pos + nfree)
+            break;
+         nfree++;
+      }
+
+      if (nfree == 0) {
+         struct ring_slot_t *slot = &ring->slots[pos & ring->mask];
+         uint64_t seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+         if ((int64_t)(seq - pos) < 0)
+            return 0;
+         pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+         continue;
+      }
+
+      if ((__atomic_compare_exchange_n (&ring->head, &pos, pos + nfree, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+         break;
+   }
+
+   for (size_t i=0; i<nfree; i++) {
+      struct ring_slot_t *slot = &ring->slots[(pos + i) & ring->mask];
+      slot->buf = bufs[i];
+      slot->buf_len = buf_lens ? buf_lens[i] : 0;
+      slot->posted_ns = posted_ns;
+      __atomic_store_n (&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+   }
+
+   return nfree;
+}
+
+bool amq_ring_push_copy (amq_ring_t *ring, const void *buf, size_t buf_len,
+                         uint64_t posted_ns)
+{
+   if (!ring->stride || buf_len > ring->msg_size)
+      return false;
+
+   uint64_t pos = 0;
+   struct ring_slot_t *slot = ring_claim (ring, &pos);
+   if (!slot)
+      return false;
+
+   if (buf_len)
+      memcpy (ring_data (ring, pos), buf, buf_len);
+   slot->buf_len = buf_len;
+   slot->posted_ns = posted_ns;
+   __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+   return true;
+}
+
+void amq_ring_release (amq_ring_t *ring, void *buf)
+{
+   size_t index = (size_t)((char *)buf - ring_data (ring, 0)) / ring->stride;
+   struct ring_slot_t *slot = &ring->slots[index];
+
+   uint64_t seq = __atomic_load_n (&slot->seq, __ATOMIC_RELAXED);
+   __atomic_store_n (&slot->seq, seq + ring->mask, __ATOMIC_RELEASE);
+}
+
+bool amq_ring_writable (amq_ring_t *ring)
+{
+   uint64_t head = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+   struct ring_slot_t *slot = &ring->slots[head & ring->mask];
+   return (int64_t)(__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) - head) >= 0;
+}
+
+size_t amq_ring_msg_size (amq_ring_t *ring)
+{
+   return ring->msg_size;
+}
+
+bool amq_ring_pop (amq_ring_t *ring, void **buf, size_t *buf_len, uint64_t *posted_ns)
+{
+   struct ring_slot_t *slot = NULL;
+   uint64_t pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+
+   for (;;) {
+      slot = &ring->slots[pos & ring->mask];
+      uint64_t seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+      int64_t diff = (int64_t)(seq - (pos + 1));
+
+      if (diff == 0) {
+         if ((__atomic_compare_exchange_n (&ring->tail, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+            break;
+      } else if (diff < 0) {
+         return false;
+      } else {
+         pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+      }
+   }
+
+   *buf = ring->stride ? ring_data (ring, pos) : slot->buf;
+   if (buf_len)
+      *buf_len = slot->buf_len;
+   if (posted_ns)
+      *posted_ns = slot->posted_ns;
+   if (!ring->stride)
+      __atomic_store_n (&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+   return true;
+}
+
+size_t amq_ring_pop_many (amq_ring_t *ring, struct amq_message_t *mesgs,
+                          uint64_t *posted_ns, size_t nmesgs)
+{
+   size_t navail = 0;
+   uint64_t pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+
+   for (;;) {
+      // Count the run of ready slots starting at pos. Nobody else can take them
+      // unless they move tail past pos first, and then our CAS fails.
+      navail = 0;
+      while (navail < nmesgs) {
+         struct ring_slot_t *slot = &ring->slots[(pos + navail) & ring->mask];
+         if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != pos + navail + 1)
+            break;
+         navail++;
+      }
+
+      if (navail == 0) {
+         struct ring_slot_t *slot = &ring->slots[pos & ring->mask];
+         uint64_t seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+         if ((int64_t)(seq - (pos + 1)) < 0)
+            return 0;
+         pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+         continue;
+      }
+
+      if ((__atomic_compare_exchange_n (&ring->tail, &pos, pos + navail, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+         break;
+   }
+
+   for (size_t i=0; i<navail; i++) {
+      struct ring_slot_t *slot = &ring->slots[(pos + i) & ring->mask];
+      mesgs[i].mesg = ring->stride ? ring_data (ring, pos + i) : slot->buf;
+      mesgs[i].mesg_len = slot->buf_len;
+      if (posted_ns)
+         posted_ns[i] = slot->posted_ns;
+      if (!ring->stride)
+         __atomic_store_n (&slot->seq, pos + i + ring->mask + 1, __ATOMIC_RELEASE);
+   }
+
+   return navail;
+}
+
+size_t amq_ring_count (amq_ring_t *ring)
+{
+   uint64_t tail = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+   uint64_t head = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+
+   if (head <= tail)
+      return 0;
+
+   return head - tail > ring->mask + 1 ? ring->mask + 1 : head - tail;
+}
+
+size_t amq_ring_capacity (amq_ring_t *ring)
+{
+   return ring->mask + 1;
+}
+
+
+/* ************************************************************
+ * The single-producer/single-consumer ring. The producer owns head and
+ * the consumer owns tail; each side keeps a cached copy of the other
+ * side's index on its own cache line and only re-reads the shared index
+ * when the cached copy says the ring is full (or empty).
+ */
+struct spsc_slot_t {
+   void       *buf;
+   size_t      buf_len;
+   uint64_t    posted_ns;
+};
+
+struct amq_spsc_t {
+   uint64_t             mask;
+   char                 pad0[AMQ_CACHELINE_SIZE - sizeof (uint64_t)];
+
+   // Written by the producer only.
+   uint64_t             head;
+   uint64_t             cached_tail;
+   char                 pad1[AMQ_CACHELINE_SIZE - 2 * sizeof (uint64_t)];
+
+   // Written by the consumer only.
+   uint64_t             tail;
+   uint64_t             cached_head;
+   char                 pad2[AMQ_CACHELINE_SIZE - 2 * sizeof (uint64_t)];
+
+   struct spsc_slot_t   slots[];
+};
+
+amq_spsc_t *amq_spsc_new (size_t capacity)
+{
+   capacity = round_up_pow2 (capacity);
+
+   amq_spsc_t *ret = calloc (1, sizeof *ret + capacity * sizeof ret->slots[0]);
+   if (!ret)
+      return NULL;
+
+   ret->mask = capacity - 1;
+
+   return ret;
+}
+
+void amq_spsc_del (amq_spsc_t *spsc)
+{
+   free (spsc);
+}
+
+bool amq_spsc_push (amq_spsc_t *spsc, void *buf, size_t buf_len, uint64_t posted_ns)
+{
+   uint64_t head = spsc->head;
+
+   if (head - spsc->cached_tail > spsc->mask) {
+      spsc->cached_tail = __atomic_load_n (&spsc->tail, __ATOMIC_ACQUIRE);
+      if (head - spsc->cached_tail > spsc->mask)
+         return false;
+   }
+
+   struct spsc_slot_t *slot = &spsc->slots[head & spsc->mask];
+   slot->buf = buf;
+   slot->buf_len = buf_len;
+   slot->posted_ns = posted_ns;
+   __atomic_store_n (&spsc->head, head + 1, __ATOMIC_RELEASE);
+
+   return true;
+}
+
+size_t amq_spsc_push_many (amq_spsc_t *spsc, void **bufs, size_t *buf_lens,
+                           uint64_t posted_ns, size_t nbufs)
+{
+   uint64_t head = spsc->head;
+   size_t capacity = spsc->mask + 1;
+
+   if (capacity - (head - spsc->cached_tail) < nbufs)
+      spsc->cached_tail = __atomic_load_n (&spsc->tail, __ATOMIC_ACQUIRE);
+
+   size_t nfree = capacity - (head - spsc->cached_tail);
+   if (nfree > nbufs)
+      nfree = nbufs;
+
+   for (size_t i=0; i<nfree; i++) {
+      struct spsc_slot_t *slot = &spsc->slots[(head + i) & spsc->mask];
+      slot->buf = bufs[i];
+      slot->buf_len = buf_lens ? buf_lens[i] : 0;
+      slot->posted_ns = posted_ns;
+   }
+
+   if (nfree)
+      __atomic_store_n (&spsc->head, head + nfree, __ATOMIC_RELEASE);
+
+   return nfree;
+}
+
+bool amq_spsc_pop (amq_spsc_t *spsc, void **buf, size_t *buf_len, uint64_t *posted_ns)
+{
+   uint64_t tail = spsc->tail;
+
+   if (tail == spsc->cached_head) {
+      spsc->cached_head = __atomic_load_n (&spsc->head, __ATOMIC_ACQUIRE);
+      if (tail == spsc->cached_head)
+         return false;
+   }
+
+   struct spsc_slot_t *slot = &spsc->slots[tail & spsc->mask];
+   *buf = slot->buf;
+   if (buf_len)
+      *buf_len = slot->buf_len;
+   if (posted_ns)
+      *posted_ns = slot->posted_ns;
+   __atomic_store_n (&spsc->tail, tail + 1, __ATOMIC_RELEASE);
+
+   return true;
+}
+
+size_t amq_spsc_pop_many (amq_spsc_t *spsc, struct amq_message_t *mesgs,
+                          uint64_t *posted_ns, size_t nmesgs)
+{
+   uint64_t tail = spsc->tail;
+
+   if (spsc->cached_head - tail < nmesgs)
+      spsc->cached_head = __atomic_load_n (&spsc->head, __ATOMIC_ACQUIRE);
+
+   size_t navail = spsc->cached_head - tail;
+   if (navail > nmesgs)
+      navail = nmesgs;
+
+   for (size_t i=0; i<navail; i++) {
+      struct spsc_slot_t *slot = &spsc->slots[(tail + i) & spsc->mask];
+      mesgs[i].mesg = slot->buf;
+      mesgs[i].mesg_len = slot->buf_len;
+      if (posted_ns)
+         posted_ns[i] = slot->posted_ns;
+   }
+
+   if (navail)
+      __atomic_store_n (&spsc->tail, tail + navail, __ATOMIC_RELEASE);
+
+   return navail;
+}
+
+size_t amq_spsc_count (amq_spsc_t *spsc)
+{
+   uint64_t tail = __atomic_load_n (&spsc->tail, __ATOMIC_RELAXED);
+   uint64_t head = __atomic_load_n (&spsc->head, __ATOMIC_RELAXED);
+
+   if (head <= tail)
+      return 0;
+
+   return head - tail > spsc->mask + 1 ? spsc->mask + 1 : head - tail;
+}
+
+size_t amq_spsc_capacity (amq_spsc_t *spsc)
+{
+   return spsc->mask + 1;
+}
+
+
+/* ************************************************************
+ * The work-stealing deque (Chase and Lev, with the memory ordering from Le
+ * et al). The owner pushes and pops at bottom; thieves take from top. Only
+ * the last message is contended, and the owner and a thief settle it with a
+ * CAS on top. A thief reads a slot before its CAS, so the slot may be
+ * overwritten under it, but then the CAS fails and what was read is thrown
+ * away; the fields are read and written atomically so that this is harmless.
+ */
+struct amq_deque_t {
+   int64_t              mask;
+   char                 pad0[AMQ_CACHELINE_SIZE - sizeof (int64_t)];
+   int64_t              top;
+   char                 pad1[AMQ_CACHELINE_SIZE - sizeof (int64_t)];
+   int64_t              bottom;
+   char                 pad2[AMQ_CACHELINE_SIZE - sizeof (int64_t)];
+   struct spsc_slot_t   slots[];
+};
+
+amq_deque_t *amq_deque_new (size_t capacity)
+{
+   capacity = round_up_pow2 (capacity);
+
+   amq_deque_t *ret = calloc (1, sizeof *ret + capacity * sizeof ret->slots[0]);
+   if (!ret)
+      return NULL;
+
+   ret->mask = capacity - 1;
+
+   return ret;
+}
+
+void amq_deque_del (amq_deque_t *deque)
+{
+   free (deque);
+}
+
+static void deque_slot_store (struct spsc_slot_t *slot, void *buf, size_t buf_len,
+                              uint64_t posted_ns)
+{
+   __atomic_store_n (&slot->buf, buf, __ATOMIC_RELAXED);
+   __atomic_store_n (&slot->buf_len, buf_len, __ATOMIC_RELAXED);
+   __atomic_store_n (&slot->posted_ns, posted_ns, __ATOMIC_RELAXED);
+}
+
+static void deque_slot_load (struct spsc_slot_t *slot, void **buf, size_t *buf_len,
+                             uint64_t *posted_ns)
+{
+   *buf = __atomic_load_n (&slot->buf, __ATOMIC_RELAXED);
+   if (buf_len)
+      *buf_len = __atomic_load_n (&slot->buf_len, __ATOMIC_RELAXED);
+   if (posted_ns)
+      *posted_ns = __atomic_load_n (&slot->posted_ns, __ATOMIC_RELAXED);
+}
+
+bool amq_deque_push (amq_deque_t *deque, void *buf, size_t buf_len, uint64_t posted_ns)
+{
+   int64_t bottom = __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED);
+   int64_t top = __atomic_load_n (&deque->top, __ATOMIC_ACQUIRE);
+
+   if (bottom - top > deque->mask)
+      return false;
+
+   deque_slot_store (&deque->slots[bottom & deque->mask], buf, buf_len, posted_ns);
+   __atomic_thread_fence (__ATOMIC_RELEASE);
+   __atomic_store_n (&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+
+   return true;
+}
+
+bool amq_deque_pop (amq_deque_t *deque, void **buf, size_t *buf_len, uint64_t *posted_ns)
+{
+   bool ret = true;
+   int64_t bottom = __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED) - 1;
+
+   __atomic_store_n (&deque->bottom, bottom, __ATOMIC_RELAXED);
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+   int64_t top = __atomic_load_n (&deque->top, __ATOMIC_RELAXED);
+
+   if (top > bottom) {
+      __atomic_store_n (&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+      return false;
+   }
+
+   deque_slot_load (&deque->slots[bottom & deque->mask], buf, buf_len, posted_ns);
+
+   if (top == bottom) {
+      // The last message: a thief may be after it as well.
+      ret = __atomic_compare_exchange_n (&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+      __atomic_store_n (&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+   }
+
+   return ret;
+}
+
+bool amq_deque_steal (amq_deque_t *deque, void **buf, size_t *buf_len, uint64_t *posted_ns)
+{
+   for (;;) {
+      int64_t top = __atomic_load_n (&deque->top, __ATOMIC_ACQUIRE);
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+      int64_t bottom = __atomic_load_n (&deque->bottom, __ATOMIC_ACQUIRE);
+
+      if (top >= bottom)
+         return false;
+
+      deque_slot_load (&deque->slots[top & deque->mask], buf, buf_len, posted_ns);
+      if ((__atomic_compare_exchange_n (&deque->top, &top, top + 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)))
+         return true;
+   }
+}
+
+size_t amq_deque_count (amq_deque_t *deque)
+{
+   int64_t top = __atomic_load_n (&deque->top, __ATOMIC_RELAXED);
+   int64_t bottom = __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED);
+
+   if (bottom <= top)
+      return 0;
+
+   return bottom - top > deque->mask + 1 ? (size_t)deque->mask + 1 : (size_t)(bottom - top);
+}
+
+
+/* ************************************************************
+ * The intrusive list. Messages are linked through the amq_msg_hdr_t at
+ * their start, so nothing is allocated; the price is a lock, which is held
+ * only long enough to splice a message (or a run of them) in or out. The
+ * count is kept outside the lock so that an empty list can be seen without
+ * taking it.
+ */
+struct amq_ilist_t {
+   pthread_mutex_t      lock;
+   amq_msg_hdr_t       *head;
+   amq_msg_hdr_t       *tail;
+   size_t               count;
+};
+
+amq_ilist_t *amq_ilist_new (void)
+{
+   amq_ilist_t *ret = calloc (1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   pthread_mutex_init (&ret->lock, NULL);
+
+   return ret;
+}
+
+void amq_ilist_del (amq_ilist_t *list)
+{
+   if (!list)
+      return;
+
+   pthread_mutex_destroy (&list->lock);
+   free (list);
+}
+
+// Append the chain from first to last, which holds n messages.
+static void ilist_append (amq_ilist_t *list, amq_msg_hdr_t *first, amq_msg_hdr_t *last,
+                          size_t n)
+{
+   pthread_mutex_lock (&list->lock);
+   if (list->tail) {
+      list->tail->next = first;
+   } else {
+      list->head = first;
+   }
+   list->tail = last;
+   __atomic_store_n (&list->count, list->count + n, __ATOMIC_RELEASE);
+   pthread_mutex_unlock (&list->lock);
+}
+
+bool amq_ilist_push (amq_ilist_t *list, void *buf, size_t buf_len, uint64_t posted_ns)
+{
+   amq_msg_hdr_t *hdr = buf;
+   if (!hdr)
+      return false;
+
+   hdr->next = NULL;
+   hdr->length = buf_len;
+   hdr->timestamp_ns = posted_ns;
+
+   ilist_append (list, hdr, hdr, 1);
+   return true;
+}
+
+size_t amq_ilist_push_many (amq_ilist_t *list, void **bufs, size_t *buf_lens,
+                            uint64_t posted_ns, size_t nbufs)
+{
+   size_t n = 0;
+   while (n < nbufs && bufs[n]) {
+      amq_msg_hdr_t *hdr = bufs[n];
+      hdr->next = n + 1 < nbufs ? bufs[n + 1] : NULL;
+      hdr->length = buf_lens ? buf_lens[n] : 0;
+      hdr->timestamp_ns = posted_ns;
+      n++;
+   }
+
+   if (!n)
+      return 0;
+
+   ((amq_msg_hdr_t *)bufs[n - 1])->next = NULL;
+   ilist_append (list, bufs[0], bufs[n - 1], n);
+   return n;
+}
+
+// Unlink up to n messages from the front, and return the first; the chain is
+// terminated with NULL.
+static amq_msg_hdr_t *ilist_remove (amq_ilist_t *list, size_t *n)
+{
+   if (!(__atomic_load_n (&list->count, __ATOMIC_ACQUIRE))) {
+      *n = 0;
+      return NULL;
+   }
+
+   pthread_mutex_lock (&list->lock);
+   amq_msg_hdr_t *ret = list->head;
+   amq_msg_hdr_t *last = NULL;
+   size_t i = 0;
+   for (amq_msg_hdr_t *tmp = ret; tmp && i < *n; tmp = tmp->next) {
+      last = tmp;
+      i++;
+   }
+   if (last) {
+      list->head = last->next;
+      if (!list->head)
+         list->tail = NULL;
+      last->next = NULL;
+   }
+   __atomic_store_n (&list->count, list->count - i, __ATOMIC_RELEASE);
+   pthread_mutex_unlock (&list->lock);
+
+   *n = i;
+   return ret;
+}
+
+bool amq_ilist_pop (amq_ilist_t *list, void **buf, size_t *buf_len, uint64_t *posted_ns)
+{
+   size_t n = 1;
+   amq_msg_hdr_t *hdr = ilist_remove (list, &n);
+   if (!hdr)
+      return false;
+
+   *buf = hdr;
+   *buf_len = hdr->length;
+   *posted_ns = hdr->timestamp_ns;
+   return true;
+}
+
+size_t amq_ilist_pop_many (amq_ilist_t *list, struct amq_message_t *mesgs,
+                           uint64_t *posted_ns, size_t nmesgs)
+{
+   size_t n = nmesgs;
+   amq_msg_hdr_t *hdr = ilist_remove (list, &n);
+
+   for (size_t i=0; i<n; i++) {
+      mesgs[i].mesg = hdr;
+      mesgs[i].mesg_len = hdr->length;
+      posted_ns[i] = hdr->timestamp_ns;
+      hdr = hdr->next;
+   }
+
+   return n;
+}
+
+size_t amq_ilist_count (amq_ilist_t *list)
+{
+   return __atomic_load_n (&list->count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,140 @@
+#ifndef H_AMQ_RING
+#define H_AMQ_RING
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "amq.h"
+
+/* ************************************************
+ * A bounded, lock-free, multi-producer/multi-consumer ring of messages.
+ * The capacity is rounded up to a power of two. Pushing and popping never
+ * block: a push onto a full ring and a pop from an empty ring both fail
+ * immediately, and the caller decides whether to sleep and retry.
+ *
+ * Each message carries a timestamp (in nanoseconds) supplied by the caller
+ * at push time, and returned to the caller at pop time.
+ */
+#define AMQ_CACHELINE_SIZE    (64)
+
+typedef struct amq_ring_t amq_ring_t;
+
+/* ************************************************
+ * A bounded, wait-free, single-producer/single-consumer ring with the same
+ * interface as amq_ring_t. Only one thread may push and only one thread may
+ * pop, although the two may be different threads.
+ */
+typedef struct amq_spsc_t amq_spsc_t;
+
+/* ************************************************
+ * A bounded work-stealing deque. One thread, the owner, pushes and pops at
+ * one end (last in, first out); any other thread may steal from the other
+ * end (first in, first out). Like the rings, nothing here blocks.
+ */
+typedef struct amq_deque_t amq_deque_t;
+
+/* ************************************************
+ * An unbounded multi-producer/multi-consumer FIFO of messages that begin with
+ * an amq_msg_hdr_t, linked through that header. Pushing fills in the header;
+ * the length and timestamp are returned from the header when popping. A NULL
+ * message cannot be pushed.
+ */
+typedef struct amq_ilist_t amq_ilist_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   amq_ring_t *amq_ring_new (size_t capacity);
+   void amq_ring_del (amq_ring_t *ring);
+
+   // An inline ring holds copies of messages of up to msg_size bytes in its own
+   // storage. Messages are pushed with amq_ring_push_copy() only, and every message
+   // that is popped must be handed back with amq_ring_release() once the caller is
+   // done with it; until then its slot cannot be reused.
+   amq_ring_t *amq_ring_new_inline (size_t capacity, size_t msg_size);
+
+   // An inline ring holds no pointers, so it can also be placed in memory that the
+   // caller provides, such as shared memory mapped at different addresses in different
+   // processes. amq_ring_inline_size() is the number of bytes needed; the memory must
+   // be zeroed and aligned to AMQ_CACHELINE_SIZE, and is initialised by
+   // amq_ring_init_inline(), which returns it as a ring. Such a ring must not be passed
+   // to amq_ring_del().
+   size_t amq_ring_inline_size (size_t capacity, size_t msg_size);
+   amq_ring_t *amq_ring_init_inline (void *mem, size_t capacity, size_t msg_size);
+   bool amq_ring_push_copy (amq_ring_t *ring, const void *buf, size_t buf_len,
+                            uint64_t posted_ns);
+   void amq_ring_release (amq_ring_t *ring, void *buf);
+   size_t amq_ring_msg_size (amq_ring_t *ring);
+
+   // Returns false if the next push would fail because the ring is full, which on an
+   // inline ring includes slots that have been popped but not yet released.
+   bool amq_ring_writable (amq_ring_t *ring);
+
+   bool amq_ring_push (amq_ring_t *ring, void *buf, size_t buf_len, uint64_t posted_ns);
+
+   // Push up to nbufs messages, claiming all the slots at once. Returns the number of
+   // messages pushed, which is less than nbufs when the ring fills up. buf_lens may be
+   // NULL, in which case all the lengths are zero.
+   size_t amq_ring_push_many (amq_ring_t *ring, void **bufs, size_t *buf_lens,
+                              uint64_t posted_ns, size_t nbufs);
+   bool amq_ring_pop (amq_ring_t *ring, void **buf, size_t *buf_len, uint64_t *posted_ns);
+
+   // Pop up to nmesgs messages that are ready, claiming all of them at once. Returns
+   // the number of messages popped.
+   size_t amq_ring_pop_many (amq_ring_t *ring, struct amq_message_t *mesgs,
+                             uint64_t *posted_ns, size_t nmesgs);
+
+   // Both of these are approximate when there are concurrent pushes and pops.
+   size_t amq_ring_count (amq_ring_t *ring);
+   size_t amq_ring_capacity (amq_ring_t *ring);
+
+   amq_spsc_t *amq_spsc_new (size_t capacity);
+   void amq_spsc_del (amq_spsc_t *spsc);
+
+   bool amq_spsc_push (amq_spsc_t *spsc, void *buf, size_t buf_len, uint64_t posted_ns);
+   size_t amq_spsc_push_many (amq_spsc_t *spsc, void **bufs, size_t *buf_lens,
+                              uint64_t posted_ns, size_t nbufs);
+   bool amq_spsc_pop (amq_spsc_t *spsc, void **buf, size_t *buf_len, uint64_t *posted_ns);
+   size_t amq_spsc_pop_many (amq_spsc_t *spsc, struct amq_message_t *mesgs,
+                             uint64_t *posted_ns, size_t nmesgs);
+
+   size_t amq_spsc_count (amq_spsc_t *spsc);
+   size_t amq_spsc_capacity (amq_spsc_t *spsc);
+
+   amq_deque_t *amq_deque_new (size_t capacity);
+   void amq_deque_del (amq_deque_t *deque);
+
+   // Only the owner may push and pop.
+   bool amq_deque_push (amq_deque_t *deque, void *buf, size_t buf_len, uint64_t posted_ns);
+   bool amq_deque_pop (amq_deque_t *deque, void **buf, size_t *buf_len, uint64_t *posted_ns);
+
+   // Any thread may steal. Returns false only when the deque is empty.
+   bool amq_deque_steal (amq_deque_t *deque, void **buf, size_t *buf_len,
+                         uint64_t *posted_ns);
+
+   size_t amq_deque_count (amq_deque_t *deque);
+
+   amq_ilist_t *amq_ilist_new (void);
+   void amq_ilist_del (amq_ilist_t *list);
+
+   // Returns false only if buf is NULL.
+   bool amq_ilist_push (amq_ilist_t *list, void *buf, size_t buf_len, uint64_t posted_ns);
+
+   // Push the messages up to the first NULL one, in a single operation, and return
+   // how many were pushed.
+   size_t amq_ilist_push_many (amq_ilist_t *list, void **bufs, size_t *buf_lens,
+                               uint64_t posted_ns, size_t nbufs);
+   bool amq_ilist_pop (amq_ilist_t *list, void **buf, size_t *buf_len, uint64_t *posted_ns);
+   size_t amq_ilist_pop_many (amq_ilist_t *list, struct amq_message_t *mesgs,
+                              uint64_t *posted_ns, size_t nmesgs);
+
+   size_t amq_ilist_count (amq_ilist_t *list);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "amq.h"
+
+/* ************************************************************
+ * A test of shared-memory queues. The process forks before either side
+ * initialises the library, then both create the same queue, so that one
+ * of them creates the shared-memory object and the other attaches to it.
+ * The child posts a run of numbered messages and the parent consumes them,
+ * checking that every message arrives once and in order. The queue is far
+ * smaller than the run, so the child keeps blocking on a full queue until
+ * the parent makes space, and the parent keeps sleeping on an empty one
+ * until the child posts: both sides are woken by the other process.
+ *
+ * Finally the parent unlinks the object and checks that it is gone.
+ */
+#define SHM_TEST_MESSAGES     (100000)
+#define SHM_TEST_CAPACITY     (16)
+#define SHM_TEST_TIMEOUT_S    (30)
+
+static uint64_t g_received;
+static uint64_t g_errors;
+
+static enum amq_worker_result_t shm_consumer (const struct amq_worker_t *self,
+                                              void *mesg, size_t mesg_len, void *cdata)
+{
+   (void)self;
+   (void)cdata;
+
+   // The message is in the queue's storage, and is not freed.
+   uint64_t seq = 0;
+   if (mesg_len != sizeof seq) {
+      __atomic_add_fetch (&g_errors, 1, __ATOMIC_RELAXED);
+      return amq_worker_result_CONTINUE;
+   }
+   memcpy (&seq, mesg, sizeof seq);
+
+   uint64_t expected = __atomic_load_n (&g_received, __ATOMIC_RELAXED);
+   if (seq != expected) {
+      fprintf (stderr, "Expected message %" PRIu64 ", received %" PRIu64 "\n",
+               expected, seq);
+      __atomic_add_fetch (&g_errors, 1, __ATOMIC_RELAXED);
+   }
+   __atomic_store_n (&g_received, seq + 1, __ATOMIC_RELEASE);
+
+   return amq_worker_result_CONTINUE;
+}
+
+static int run_producer (const char *name)
+{
+   int ret = EXIT_FAILURE;
+
+   if (!(amq_lib_init ())) {
+      fprintf (stderr, "Producer: failed to initialise the library\n");
+      return EXIT_FAILURE;
+   }
+
+   if (!(amq_message_queue_create_shm (name, SHM_TEST_CAPACITY, sizeof (uint64_t)))) {
+      fprintf (stderr, "Producer: failed to create queue [%s]\n", name);
+      goto errorexit;
+   }
+
+   for (uint64_t i=0; i<SHM_TEST_MESSAGES; i++) {
+      enum amq_post_result_t rc = amq_post_copy (name, &i, sizeof i);
+      if (rc != amq_post_result_OK) {
+         fprintf (stderr, "Producer: failed to post message %" PRIu64 " [%i]\n", i, rc);
+         goto errorexit;
+      }
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   amq_lib_destroy ();
+   return ret;
+}
+
+static int run_consumer (const char *name, pid_t producer)
+{
+   int ret = EXIT_FAILURE;
+   int status = 0;
+
+   if (!(amq_lib_init ())) {
+      fprintf (stderr, "Consumer: failed to initialise the library\n");
+      goto errorexit;
+   }
+
+   if (!(amq_message_queue_create_shm (name, SHM_TEST_CAPACITY, sizeof (uint64_t)))) {
+      fprintf (stderr, "Consumer: failed to create queue [%s]\n", name);
+      goto errorexit;
+   }
+
+   if (!(amq_consumer_create (name, "ShmConsumer", shm_consumer, NULL))) {
+      fprintf (stderr, "Consumer: failed to create the consumer\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<SHM_TEST_TIMEOUT_S * 100; i++) {
+      if (__atomic_load_n (&g_received, __ATOMIC_ACQUIRE) >= SHM_TEST_MESSAGES)
+         break;
+      usleep (10000);
+   }
+
+   amq_worker_sigset ("ShmConsumer", AMQ_SIGNAL_TERMINATE);
+   amq_worker_wait ("ShmConsumer");
+
+   if (g_received != SHM_TEST_MESSAGES || g_errors) {
+      fprintf (stderr, "Consumer: received %" PRIu64 " of %i messages, %" PRIu64 " errors\n",
+               g_received, SHM_TEST_MESSAGES, g_errors);
+      goto errorexit;
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   if (producer > 0) {
+      if (ret != EXIT_SUCCESS)
+         kill (producer, SIGKILL);
+      if ((waitpid (producer, &status, 0)) != producer || !WIFEXITED (status) ||
+          WEXITSTATUS (status) != EXIT_SUCCESS) {
+         fprintf (stderr, "Producer failed\n");
+         ret = EXIT_FAILURE;
+      }
+   }
+
+   if (!(amq_message_queue_unlink_shm (name))) {
+      fprintf (stderr, "Failed to unlink queue [%s]\n", name);
+      ret = EXIT_FAILURE;
+   }
+
+   char path[128];
+   snprintf (path, sizeof path, "/amq.%s", name);
+   int fd = shm_open (path, O_RDWR, 0);
+   if (fd >= 0 || errno != ENOENT) {
+      fprintf (stderr, "[%s] still exists after being unlinked\n", path);
+      if (fd >= 0)
+         close (fd);
+      ret = EXIT_FAILURE;
+   }
+
+   amq_lib_destroy ();
+   return ret;
+}
+
+int main (void)
+{
+   char name[64];
+   snprintf (name, sizeof name, "AMQ_SHM_TEST.%ld", (long)getpid ());
+
+   fflush (stdout);
+
+   pid_t pid = fork ();
+   if (pid < 0) {
+      fprintf (stderr, "Failed to fork: %s\n", strerror (errno));
+      return EXIT_FAILURE;
+   }
+   if (pid == 0)
+      exit (run_producer (name));
+
+   int ret = run_consumer (name, pid);
+   printf ("Shared-memory queue test: %s\n", ret == EXIT_SUCCESS ? "passed" : "failed");
+   return ret;
+}
@@ -0,0 +1,261 @@
+#include <string.h>
+
+#include <pthread.h>
+
+#include "amq_slab.h"
+#include "amq_ring.h"
+
+/* ************************************************************
+ * Buffers come in power-of-two size classes from 64 bytes up to
+ * 64 << (SLAB_NCLASSES - 1), including a 16-byte header that records the
+ * cache that owns the buffer and its size class. Each cache carves its
+ * buffers out of chunks of SLAB_CHUNK_SIZE bytes, which are only returned to
+ * the system when the slab is deleted.
+ *
+ * While a buffer is free, the first word of its header links it into a free
+ * list; the size class in the second word is left alone so that a cache can
+ * sort the buffers that other threads hand back to it.
+ */
+#define SLAB_MIN_SHIFT     (6)
+#define SLAB_NCLASSES      (8)
+#define SLAB_CHUNK_SIZE    (64 * 1024)
+#define SLAB_BATCH         (32)
+#define SLAB_TL_CACHES     (8)
+
+struct slab_hdr_t {
+   union {
+      struct slab_cache_t  *cache;
+      struct slab_hdr_t    *next;
+   } link;
+   size_t                   size_class;
+};
+
+struct slab_chunk_t {
+   struct slab_chunk_t  *next;
+   size_t                pad;
+};
+
+// Everything except remote is only touched by the owning thread.
+struct slab_cache_t {
+   const void           *owner;
+   struct slab_cache_t  *next;
+   struct slab_chunk_t  *chunks;
+   struct slab_hdr_t    *free[SLAB_NCLASSES];
+   char                  pad[AMQ_CACHELINE_SIZE];
+
+   // Buffers handed back by other threads, as a lock-free stack.
+   struct slab_hdr_t    *remote;
+};
+
+struct amq_slab_t {
+   uint64_t              id;
+   pthread_mutex_t       lock;
+   struct slab_cache_t  *caches;
+};
+
+// Slabs are told apart by id rather than by address in the thread-local
+// lookup table, so that a new slab at the address of a deleted one is not
+// mistaken for it.
+static uint64_t g_slab_id;
+
+// The address of tl_owner identifies the thread.
+static __thread char tl_owner;
+
+static __thread struct {
+   uint64_t              slab_id;
+   struct slab_cache_t  *cache;
+} tl_caches[SLAB_TL_CACHES];
+static __thread size_t tl_caches_next;
+
+// Buffers released by this thread that belong to another thread's cache.
+static __thread struct {
+   struct slab_cache_t  *cache;
+   struct slab_hdr_t    *head;
+   struct slab_hdr_t    *tail;
+   size_t                count;
+} tl_batch;
+
+amq_slab_t *amq_slab_new (void)
+{
+   amq_slab_t *ret = calloc (1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   ret->id = __atomic_add_fetch (&g_slab_id, 1, __ATOMIC_RELAXED);
+   pthread_mutex_init (&ret->lock, NULL);
+
+   return ret;
+}
+
+void amq_slab_del (amq_slab_t *slab)
+{
+   if (!slab)
+      return;
+
+   struct slab_cache_t *cache = slab->caches;
+   while (cache) {
+      struct slab_cache_t *next_cache = cache->next;
+      struct slab_chunk_t *chunk = cache->chunks;
+      while (chunk) {
+         struct slab_chunk_t *next_chunk = chunk->next;
+         free (chunk);
+         chunk = next_chunk;
+      }
+      free (cache);
+      cache = next_cache;
+   }
+
+   pthread_mutex_destroy (&slab->lock);
+   free (slab);
+}
+
+static size_t size_class (size_t size)
+{
+   size_t ret = 0;
+   size += sizeof (struct slab_hdr_t);
+   while (ret < SLAB_NCLASSES && ((size_t)1 << (ret + SLAB_MIN_SHIFT)) < size)
+      ret++;
+   return ret;
+}
+
+// Find the calling thread's cache for the slab, creating it if need be.
+static struct slab_cache_t *slab_cache (amq_slab_t *slab)
+{
+   for (size_t i=0; i<SLAB_TL_CACHES; i++) {
+      if (tl_caches[i].slab_id == slab->id)
+         return tl_caches[i].cache;
+   }
+
+   struct slab_cache_t *ret = NULL;
+
+   pthread_mutex_lock (&slab->lock);
+   for (ret=slab->caches; ret && ret->owner != &tl_owner; ret=ret->next)
+      ;
+   if (!ret && (ret = calloc (1, sizeof *ret))) {
+      ret->owner = &tl_owner;
+      ret->next = slab->caches;
+      slab->caches = ret;
+   }
+   pthread_mutex_unlock (&slab->lock);
+
+   if (ret) {
+      size_t i = tl_caches_next++ % SLAB_TL_CACHES;
+      tl_caches[i].slab_id = slab->id;
+      tl_caches[i].cache = ret;
+   }
+
+   return ret;
+}
+
+// Sort the buffers that other threads have handed back onto the free lists.
+static void cache_drain (struct slab_cache_t *cache)
+{
+   struct slab_hdr_t *hdr = __atomic_exchange_n (&cache->remote, NULL, __ATOMIC_ACQUIRE);
+   while (hdr) {
+      struct slab_hdr_t *next = hdr->link.next;
+      hdr->link.next = cache->free[hdr->size_class];
+      cache->free[hdr->size_class] = hdr;
+      hdr = next;
+   }
+}
+
+static bool cache_grow (struct slab_cache_t *cache, size_t sclass)
+{
+   size_t objsize = (size_t)1 << (sclass + SLAB_MIN_SHIFT);
+   struct slab_chunk_t *chunk = malloc (SLAB_CHUNK_SIZE);
+   if (!chunk)
+      return false;
+
+   chunk->next = cache->chunks;
+   cache->chunks = chunk;
+
+   char *base = (char *)(chunk + 1);
+   size_t nobjs = (SLAB_CHUNK_SIZE - sizeof *chunk) / objsize;
+   for (size_t i=nobjs; i>0; i--) {
+      struct slab_hdr_t *hdr = (struct slab_hdr_t *)(base + (i - 1) * objsize);
+      hdr->size_class = sclass;
+      hdr->link.next = cache->free[sclass];
+      cache->free[sclass] = hdr;
+   }
+
+   return true;
+}
+
+void *amq_slab_alloc (amq_slab_t *slab, size_t size)
+{
+   size_t sclass = size_class (size);
+   struct slab_hdr_t *hdr = NULL;
+
+   if (sclass >= SLAB_NCLASSES) {
+      if (!(hdr = malloc (sizeof *hdr + size)))
+         return NULL;
+      hdr->link.cache = NULL;
+      hdr->size_class = sclass;
+      return hdr + 1;
+   }
+
+   struct slab_cache_t *cache = slab_cache (slab);
+   if (!cache)
+      return NULL;
+
+   if (!cache->free[sclass]) {
+      cache_drain (cache);
+      if (!cache->free[sclass] && !(cache_grow (cache, sclass)))
+         return NULL;
+   }
+
+   hdr = cache->free[sclass];
+   cache->free[sclass] = hdr->link.next;
+   hdr->link.cache = cache;
+
+   return hdr + 1;
+}
+
+void amq_slab_flush (void)
+{
+   if (!tl_batch.count)
+      return;
+
+   struct slab_cache_t *cache = tl_batch.cache;
+   struct slab_hdr_t *head = __atomic_load_n (&cache->remote, __ATOMIC_RELAXED);
+   do {
+      tl_batch.tail->link.next = head;
+   } while (!(__atomic_compare_exchange_n (&cache->remote, &head, tl_batch.head, true,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED)));
+
+   tl_batch.cache = NULL;
+   tl_batch.head = tl_batch.tail = NULL;
+   tl_batch.count = 0;
+}
+
+void amq_slab_free (void *buf)
+{
+   if (!buf)
+      return;
+
+   struct slab_hdr_t *hdr = (struct slab_hdr_t *)buf - 1;
+   struct slab_cache_t *cache = hdr->link.cache;
+
+   if (!cache) {
+      free (hdr);
+      return;
+   }
+
+   if (cache->owner == &tl_owner) {
+      hdr->link.next = cache->free[hdr->size_class];
+      cache->free[hdr->size_class] = hdr;
+      return;
+   }
+
+   if (tl_batch.cache != cache)
+      amq_slab_flush ();
+
+   tl_batch.cache = cache;
+   hdr->link.next = tl_batch.head;
+   tl_batch.head = hdr;
+   if (!tl_batch.tail)
+      tl_batch.tail = hdr;
+
+   if (++tl_batch.count >= SLAB_BATCH)
+      amq_slab_flush ();
+}
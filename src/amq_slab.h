@@ -0,0 +1,47 @@
+#ifndef H_AMQ_SLAB
+#define H_AMQ_SLAB
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* ************************************************
+ * A slab allocator for message buffers. Every thread that allocates from a
+ * slab gets a cache of its own, so allocating never takes a lock. A buffer
+ * released by the thread that allocated it goes straight back on that
+ * thread's free list; a buffer released by any other thread is added to a
+ * per-thread batch, and the batch is handed back to the owning cache in a
+ * single atomic operation when it fills up, when the releasing thread moves
+ * on to another cache, or when amq_slab_flush() is called.
+ *
+ * Buffers larger than the largest size class come from malloc(), and are
+ * released with free().
+ */
+
+typedef struct amq_slab_t amq_slab_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   amq_slab_t *amq_slab_new (void);
+
+   // Every buffer allocated from the slab must have been released, and every
+   // thread that released one must have flushed, before the slab is deleted.
+   void amq_slab_del (amq_slab_t *slab);
+
+   // Returns NULL if out of memory.
+   void *amq_slab_alloc (amq_slab_t *slab, size_t size);
+   void amq_slab_free (void *buf);
+
+   // Hand the calling thread's batch of released buffers back to their owner.
+   // A thread should call this before it goes idle or exits, otherwise the
+   // batch stays out of use.
+   void amq_slab_flush (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
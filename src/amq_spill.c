@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "amq_spill.h"
+
+// Every message is preceded by a record header, and padded so that the next
+// header is aligned.
+struct record_t {
+   uint64_t    len;
+   uint64_t    posted_ns;
+};
+
+#define RECORD_ALIGN       (sizeof (uint64_t))
+#define RECORD_SIZE(len)   ((sizeof (struct record_t) + (len) + RECORD_ALIGN - 1) \
+                              & ~(RECORD_ALIGN - 1))
+
+struct segment_t {
+   struct segment_t *next;
+   char             *path;
+   int               fd;
+   char             *base;      // NULL while the segment is unmapped
+   size_t            size;
+   size_t            used;      // Bytes appended
+   size_t            read;      // Bytes read back
+};
+
+struct amq_spill_t {
+   pthread_mutex_t   lock;
+   char             *dir;
+   char             *prefix;
+   size_t            segment_size;
+   uint64_t          nsegments; // Numbers the segment files
+   struct segment_t *head;      // Read from here
+   struct segment_t *tail;      // Appended to here
+   size_t            count;
+};
+
+static bool segment_map (struct segment_t *seg)
+{
+   void *base = mmap (NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+   if (base == MAP_FAILED)
+      return false;
+
+   seg->base = base;
+   return true;
+}
+
+static void segment_unmap (struct segment_t *seg)
+{
+   if (seg->base)
+      munmap (seg->base, seg->size);
+   seg->base = NULL;
+}
+
+static void segment_del (struct segment_t *seg)
+{
+   if (!seg)
+      return;
+
+   segment_unmap (seg);
+   if (seg->fd >= 0) {
+      close (seg->fd);
+      unlink (seg->path);
+   }
+   free (seg->path);
+   free (seg);
+}
+
+static struct segment_t *segment_new (amq_spill_t *spill, size_t size)
+{
+   struct segment_t *ret = calloc (1, sizeof *ret);
+   int saved_errno = ENOMEM;
+
+   if (!ret)
+      goto errorexit;
+
+   ret->fd = -1;
+   ret->size = size;
+
+   int len = snprintf (NULL, 0, "%s/%s.%" PRIu64 ".spill",
+                       spill->dir, spill->prefix, spill->nsegments);
+   if (!(ret->path = malloc (len + 1)))
+      goto errorexit;
+   snprintf (ret->path, len + 1, "%s/%s.%" PRIu64 ".spill",
+             spill->dir, spill->prefix, spill->nsegments++);
+
+   if ((ret->fd = open (ret->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+      saved_errno = errno;
+      goto errorexit;
+   }
+
+   // Reserving the blocks now means that running out of disk fails here,
+   // instead of raising SIGBUS when the mapping is written to.
+   if ((saved_errno = posix_fallocate (ret->fd, 0, size)) != 0)
+      goto errorexit;
+
+   if (!(segment_map (ret))) {
+      saved_errno = errno;
+      goto errorexit;
+   }
+
+   return ret;
+
+errorexit:
+   segment_del (ret);
+   errno = saved_errno;
+   return NULL;
+}
+
+amq_spill_t *amq_spill_new (const char *dir, const char *prefix, size_t segment_size)
+{
+   amq_spill_t *ret = calloc (1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   pthread_mutex_init (&ret->lock, NULL);
+   ret->dir = strdup (dir);
+   ret->prefix = strdup (prefix);
+   ret->segment_size = segment_size ? segment_size : AMQ_SPILL_SEGMENT_SIZE;
+
+   if (!ret->dir || !ret->prefix) {
+      amq_spill_del (ret);
+      return NULL;
+   }
+
+   // The prefix is part of a file name.
+   for (char *tmp = ret->prefix; (tmp = strchr (tmp, '/')); tmp++) {
+      *tmp = '_';
+   }
+
+   return ret;
+}
+
+void amq_spill_del (amq_spill_t *spill)
+{
+   if (!spill)
+      return;
+
+   while (spill->head) {
+      struct segment_t *next = spill->head->next;
+      segment_del (spill->head);
+      spill->head = next;
+   }
+   pthread_mutex_destroy (&spill->lock);
+   free (spill->dir);
+   free (spill->prefix);
+   free (spill);
+}
+
+bool amq_spill_append (amq_spill_t *spill, const void *buf, size_t len,
+                       uint64_t posted_ns)
+{
+   size_t needed = RECORD_SIZE (len);
+   struct record_t rec = { len, posted_ns };
+   bool ret = false;
+
+   pthread_mutex_lock (&spill->lock);
+
+   struct segment_t *seg = spill->tail;
+   if (!seg || seg->size - seg->used < needed) {
+      struct segment_t *next = segment_new (spill, needed > spill->segment_size
+                                                   ? needed : spill->segment_size);
+      if (!next)
+         goto errorexit;
+
+      if (seg) {
+         // Nothing more is written to a full segment, so unless it is being
+         // read its pages can be written back and reclaimed.
+         if (seg != spill->head)
+            segment_unmap (seg);
+         seg->next = next;
+      } else {
+         spill->head = next;
+      }
+      spill->tail = seg = next;
+   }
+
+   memcpy (seg->base + seg->used, &rec, sizeof rec);
+   memcpy (seg->base + seg->used + sizeof rec, buf, len);
+   seg->used += needed;
+   __atomic_add_fetch (&spill->count, 1, __ATOMIC_RELAXED);
+   ret = true;
+
+errorexit:
+   pthread_mutex_unlock (&spill->lock);
+   return ret;
+}
+
+bool amq_spill_read (amq_spill_t *spill, amq_spill_alloc_func_t *alloc_func,
+                     void *cdata, void **buf, size_t *len, uint64_t *posted_ns)
+{
+   struct record_t rec;
+   bool ret = false;
+
+   pthread_mutex_lock (&spill->lock);
+
+   // A segment that has been read to the end is done with once appends have
+   // moved on to the next one.
+   struct segment_t *seg = spill->head;
+   while (seg && seg->read == seg->used && seg != spill->tail) {
+      spill->head = seg->next;
+      segment_del (seg);
+      seg = spill->head;
+   }
+
+   if (!seg || seg->read == seg->used)
+      goto errorexit;
+
+   if (!seg->base) {
+      if (!(segment_map (seg)))
+         goto errorexit;
+      posix_madvise (seg->base, seg->size, POSIX_MADV_SEQUENTIAL);
+      posix_madvise (seg->base, seg->used, POSIX_MADV_WILLNEED);
+   }
+
+   memcpy (&rec, seg->base + seg->read, sizeof rec);
+   if (!(*buf = alloc_func (cdata, rec.len))) {
+      errno = ENOMEM;
+      goto errorexit;
+   }
+
+   memcpy (*buf, seg->base + seg->read + sizeof rec, rec.len);
+   *len = rec.len;
+   *posted_ns = rec.posted_ns;
+   seg->read += RECORD_SIZE (rec.len);
+
+   // Once everything has been read, appends start again at the beginning of
+   // the last segment instead of creating another.
+   if (seg == spill->tail && seg->read == seg->used)
+      seg->read = seg->used = 0;
+
+   __atomic_sub_fetch (&spill->count, 1, __ATOMIC_RELAXED);
+   ret = true;
+
+errorexit:
+   pthread_mutex_unlock (&spill->lock);
+   return ret;
+}
+
+size_t amq_spill_count (amq_spill_t *spill)
+{
+   return __atomic_load_n (&spill->count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,61 @@
+#ifndef H_AMQ_SPILL
+#define H_AMQ_SPILL
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* ************************************************
+ * An append-only log of messages on disk, for queues that overflow their
+ * memory limit. The log is a list of segment files in a directory, each
+ * mapped with mmap() and space for it reserved when it is created, so that
+ * a full disk makes an append fail instead of raising SIGBUS. Messages are
+ * read back in the order they were appended; a segment is unmapped as soon
+ * as it is full and mapped again with read-ahead advice when reading gets
+ * to it, and is deleted once it has been read.
+ *
+ * Every function may be called from any thread.
+ */
+
+// The size of each segment file. A message too large for a segment gets a
+// segment of its own.
+#define AMQ_SPILL_SEGMENT_SIZE      (64 * 1024 * 1024)
+
+typedef struct amq_spill_t amq_spill_t;
+
+// Allocates the buffer that a message is read back into.
+typedef void *(amq_spill_alloc_func_t) (void *cdata, size_t len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Segment files are created in dir, with names that start with prefix.
+   // A segment_size of 0 uses AMQ_SPILL_SEGMENT_SIZE. Returns NULL if out
+   // of memory.
+   amq_spill_t *amq_spill_new (const char *dir, const char *prefix, size_t segment_size);
+
+   // Deletes every segment file, along with any messages still in them.
+   void amq_spill_del (amq_spill_t *spill);
+
+   // Copies the message to the end of the log. Returns false, with errno
+   // set, if it could not be written.
+   bool amq_spill_append (amq_spill_t *spill, const void *buf, size_t len,
+                          uint64_t posted_ns);
+
+   // Removes the oldest message from the log into a buffer from alloc_func,
+   // which is passed cdata. Returns false if the log is empty, or, with errno
+   // set, if the segment cannot be mapped or the buffer cannot be allocated, in
+   // which case the message stays in the log.
+   bool amq_spill_read (amq_spill_t *spill, amq_spill_alloc_func_t *alloc_func,
+                        void *cdata, void **buf, size_t *len, uint64_t *posted_ns);
+
+   // The number of messages in the log.
+   size_t amq_spill_count (amq_spill_t *spill);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
@@ -16,13 +16,20 @@
 
 static void stats_dump (const struct amq_worker_t *w)
 {
-   printf ("[statistics:%s] count:%zu, min=%0.4f, max=%0.4f, avg=%0.4f, dev=%0.4f\n",
+   struct amq_stats_t stats;
+   if (!(amq_worker_stats_get (w->worker_name, &stats)))
+      return;
+
+   printf ("[statistics:%s] count:%" PRIu64 ", min=%" PRIu64 "ns, max=%" PRIu64 "ns, "
+           "avg=%0.1fns, dev=%0.1fns, p50=%" PRIu64 "ns, p99=%" PRIu64 "ns\n",
             w->worker_name,
-            w->stats.count,
-            w->stats.min,
-            w->stats.max,
-            w->stats.average,
-            w->stats.deviation);
+            stats.count,
+            stats.min_ns,
+            stats.max_ns,
+            stats.mean_ns,
+            stats.stddev_ns,
+            stats.p50_ns,
+            stats.p99_ns);
 }
 
 static enum amq_worker_result_t gen_event (const struct amq_worker_t *self,
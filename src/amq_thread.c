@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sched.h>
+
+#include "amq_thread.h"
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/mempolicy.h>
+
+/* ************************************************************
+ * NUMA placement is done without libnuma: the CPUs of a node are read from
+ * sysfs, and the memory policy is set with the raw system call.
+ */
+#define NODE_CPULIST    "/sys/devices/system/node/node%i/cpulist"
+
+// Parse a list such as "0-3,8-11" into set. Returns false if the node does
+// not exist.
+static bool node_cpus (int node, cpu_set_t *set)
+{
+   char fname[64];
+   char line[1024];
+   FILE *inf = NULL;
+   bool ret = false;
+
+   snprintf (fname, sizeof fname, NODE_CPULIST, node);
+   if (!(inf = fopen (fname, "r")))
+      return false;
+
+   if (!(fgets (line, sizeof line, inf)))
+      goto errorexit;
+
+   CPU_ZERO (set);
+
+   char *tmp = line;
+   while (*tmp && *tmp != '\n') {
+      char *end = NULL;
+      long first = strtol (tmp, &end, 10);
+      long last = first;
+      if (end == tmp)
+         goto errorexit;
+      if (*end == '-') {
+         tmp = end + 1;
+         last = strtol (tmp, &end, 10);
+         if (end == tmp)
+            goto errorexit;
+      }
+      for (long i=first; i<=last && i<CPU_SETSIZE; i++) {
+         CPU_SET (i, set);
+      }
+      tmp = *end == ',' ? end + 1 : end;
+   }
+
+   ret = true;
+
+errorexit:
+   fclose (inf);
+   return ret;
+}
+
+#endif
+
+bool amq_thread_attr_init (pthread_attr_t *pattr, const struct amq_worker_attr_t *attr)
+{
+   pthread_attr_init (pattr);
+   if (!attr)
+      return true;
+
+   int rc = 0;
+
+   if (attr->stack_size &&
+       (rc = pthread_attr_setstacksize (pattr, attr->stack_size)) != 0) {
+      AMQ_ERROR_POST (rc, "Invalid stack size %zu\n", attr->stack_size);
+      return false;
+   }
+
+#ifdef __linux__
+   if (attr->ncpus || attr->numa_node >= 0) {
+      cpu_set_t set, node_set;
+      CPU_ZERO (&set);
+
+      for (size_t i=0; i<attr->ncpus; i++) {
+         if (attr->cpus[i] < 0 || attr->cpus[i] >= CPU_SETSIZE) {
+            AMQ_ERROR_POST (EINVAL, "Invalid CPU %i\n", attr->cpus[i]);
+            return false;
+         }
+         CPU_SET (attr->cpus[i], &set);
+      }
+
+      if (attr->numa_node >= 0) {
+         if (!(node_cpus (attr->numa_node, &node_set))) {
+            AMQ_ERROR_POST (EINVAL, "NUMA node %i does not exist\n", attr->numa_node);
+            return false;
+         }
+         if (attr->ncpus) {
+            CPU_AND (&set, &set, &node_set);
+         } else {
+            CPU_OR (&set, &set, &node_set);
+         }
+      }
+
+      if (CPU_COUNT (&set) == 0) {
+         AMQ_ERROR_POST (EINVAL, "None of the requested CPUs are on NUMA node %i\n",
+                                 attr->numa_node);
+         return false;
+      }
+
+      if ((rc = pthread_attr_setaffinity_np (pattr, sizeof set, &set)) != 0) {
+         AMQ_ERROR_POST (rc, "Failed to set CPU affinity\n");
+         return false;
+      }
+   }
+#endif
+
+   if (attr->realtime) {
+      struct sched_param param = { .sched_priority = attr->priority };
+      if ((rc = pthread_attr_setinheritsched (pattr, PTHREAD_EXPLICIT_SCHED)) != 0 ||
+          (rc = pthread_attr_setschedpolicy (pattr, SCHED_FIFO)) != 0 ||
+          (rc = pthread_attr_setschedparam (pattr, &param)) != 0) {
+         AMQ_ERROR_POST (rc, "Invalid SCHED_FIFO priority %i\n", attr->priority);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+void amq_thread_setup (const char *name, const struct amq_worker_attr_t *attr)
+{
+#ifdef __linux__
+   if (name) {
+      // Linux limits thread names to 15 characters.
+      char tname[16];
+      snprintf (tname, sizeof tname, "%s", name);
+      pthread_setname_np (pthread_self (), tname);
+   }
+
+   if (!attr)
+      return;
+
+   if (!attr->realtime && attr->priority &&
+       (setpriority (PRIO_PROCESS, syscall (SYS_gettid), attr->priority)) != 0) {
+      AMQ_ERROR_POST (errno, "[%s] Failed to set nice value %i: %m\n", name,
+                             attr->priority);
+   }
+
+   if (attr->numa_node >= 0) {
+      unsigned long mask[16] = { 0 };
+      size_t bits = sizeof mask[0] * 8;
+      if ((size_t)attr->numa_node < sizeof mask * 8) {
+         mask[attr->numa_node / bits] = 1UL << (attr->numa_node % bits);
+         if ((syscall (SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof mask * 8)) != 0) {
+            AMQ_ERROR_POST (errno, "[%s] Failed to prefer memory on NUMA node %i: %m\n",
+                                   name, attr->numa_node);
+         }
+      }
+   }
+#else
+   (void)name;
+   (void)attr;
+#endif
+}
@@ -0,0 +1,42 @@
+#ifndef H_AMQ_THREAD
+#define H_AMQ_THREAD
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "amq.h"
+
+/* ************************************************
+ * Applies struct amq_worker_attr_t to worker threads. Some attributes can be
+ * set before the thread is created (stack size, CPU affinity, real-time
+ * scheduling) and the rest only by the thread itself (name, nice value, NUMA
+ * memory policy), so there is one function for each half.
+ *
+ * CPU affinity, NUMA placement, thread names and the nice value are only
+ * supported on Linux; elsewhere they are ignored. Other platforms have no
+ * portable way to renice a single thread.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Initialise pattr from attr, which may be NULL. Returns false, with an error
+   // posted to AMQ_QUEUE_ERROR, if the attributes are invalid. The caller must
+   // destroy pattr whether or not this succeeds.
+   bool amq_thread_attr_init (pthread_attr_t *pattr, const struct amq_worker_attr_t *attr);
+
+   // Called by the new thread itself. Names the thread after name (truncated to
+   // what the platform allows), and applies the nice value and NUMA memory
+   // policy in attr, which may be NULL. Failures are posted to AMQ_QUEUE_ERROR
+   // but do not stop the thread.
+   void amq_thread_setup (const char *name, const struct amq_worker_attr_t *attr);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif